@@ -58,6 +58,8 @@ void              libmsi_query_get_error         (LibmsiQuery *query,
 LibmsiRecord *    libmsi_query_get_column_info   (LibmsiQuery *query,
                                                   LibmsiColInfo info,
                                                   GError **error);
+gchar *           libmsi_query_explain           (LibmsiQuery *query,
+                                                  GError **error);
 
 G_END_DECLS
 
@@ -224,6 +224,8 @@ static const LibmsiViewOps alter_ops =
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
 };
 
 unsigned alter_view_create( LibmsiDatabase *db, LibmsiView **view, const char *name, column_info *colinfo, int hold )
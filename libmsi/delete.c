@@ -154,6 +154,18 @@ static unsigned delete_view_find_matching_rows( LibmsiView *view, unsigned col,
     return LIBMSI_RESULT_FUNCTION_FAILED;
 }
 
+static unsigned delete_view_explain( LibmsiView *view, GString *plan )
+{
+    LibmsiDeleteView *dv = (LibmsiDeleteView*)view;
+
+    TRACE("%p %p\n", dv, plan);
+
+    if( !dv->table )
+         return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return msi_view_explain( dv->table, plan );
+}
+
 
 static const LibmsiViewOps delete_ops =
 {
@@ -175,6 +187,8 @@ static const LibmsiViewOps delete_ops =
     NULL,
     NULL,
     NULL,
+    delete_view_explain,
+    NULL,
 };
 
 unsigned delete_view_create( LibmsiDatabase *db, LibmsiView **view, LibmsiView *table )
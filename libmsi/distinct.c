@@ -247,6 +247,18 @@ static unsigned distinct_view_find_matching_rows( LibmsiView *view, unsigned col
     return r;
 }
 
+static unsigned distinct_view_explain( LibmsiView *view, GString *plan )
+{
+    LibmsiDistinctView *dv = (LibmsiDistinctView*)view;
+
+    TRACE("%p %p\n", dv, plan);
+
+    if( !dv->table )
+         return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return msi_view_explain( dv->table, plan );
+}
+
 static const LibmsiViewOps distinct_ops =
 {
     distinct_view_fetch_int,
@@ -267,6 +279,8 @@ static const LibmsiViewOps distinct_ops =
     NULL,
     NULL,
     NULL,
+    distinct_view_explain,
+    NULL,
 };
 
 unsigned distinct_view_create( LibmsiDatabase *db, LibmsiView **view, LibmsiView *table )
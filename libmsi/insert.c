@@ -331,6 +331,8 @@ static const LibmsiViewOps insert_ops =
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
 };
 
 G_GNUC_PURE
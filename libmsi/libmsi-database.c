@@ -71,12 +71,116 @@ typedef struct _LibmsiStorage {
     GsfInfile *stg;
 } LibmsiStorage;
 
+/* streams of the database file are only opened when first used, until
+ * then stm is NULL */
 typedef struct _LibmsiStream {
     struct list entry;
     char *name;
     GsfInput *stm;
 } LibmsiStream;
 
+#define NAME_INDEX_MIN_SIZE 16
+
+/* the caller guarantees there is a free entry */
+static void name_index_put( LibmsiNameIndex *index, unsigned hash, const char *name, void *value )
+{
+    unsigned i = hash & index->mask;
+
+    while (index->entries[i].name)
+        i = (i + 1) & index->mask;
+
+    index->entries[i].hash = hash;
+    index->entries[i].name = name;
+    index->entries[i].value = value;
+    index->count++;
+}
+
+bool msi_name_index_add( LibmsiNameIndex *index, const char *name, void *value )
+{
+    if ((index->count + 1) * 2 > index->mask + 1)
+    {
+        LibmsiNameIndex grown;
+        unsigned i, size;
+
+        size = index->entries ? (index->mask + 1) * 2 : NAME_INDEX_MIN_SIZE;
+        grown.mask = size - 1;
+        grown.count = 0;
+        grown.entries = msi_alloc_zero( size * sizeof(LibmsiNameIndexEntry) );
+        if (!grown.entries)
+            return false;
+
+        for (i = 0; index->entries && i <= index->mask; i++)
+        {
+            if (index->entries[i].name)
+                name_index_put( &grown, index->entries[i].hash,
+                                index->entries[i].name, index->entries[i].value );
+        }
+        msi_free( index->entries );
+        *index = grown;
+    }
+
+    name_index_put( index, g_str_hash( name ), name, value );
+    return true;
+}
+
+static int name_index_lookup( const LibmsiNameIndex *index, const char *name )
+{
+    unsigned hash, i;
+
+    if (!index->entries)
+        return -1;
+
+    hash = g_str_hash( name );
+    for (i = hash & index->mask; index->entries[i].name; i = (i + 1) & index->mask)
+    {
+        if (index->entries[i].hash == hash && !strcmp( index->entries[i].name, name ))
+            return i;
+    }
+    return -1;
+}
+
+void *msi_name_index_find( const LibmsiNameIndex *index, const char *name )
+{
+    int i = name_index_lookup( index, name );
+
+    return i < 0 ? NULL : index->entries[i].value;
+}
+
+void msi_name_index_remove( LibmsiNameIndex *index, const char *name )
+{
+    int n = name_index_lookup( index, name );
+    unsigned i, j, k;
+
+    if (n < 0)
+        return;
+
+    /* move back any following entry whose probe sequence went through i */
+    for (i = j = n;;)
+    {
+        j = (j + 1) & index->mask;
+        if (!index->entries[j].name)
+            break;
+
+        k = index->entries[j].hash & index->mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        index->entries[i] = index->entries[j];
+        i = j;
+    }
+
+    index->entries[i].name = NULL;
+    index->count--;
+}
+
+void msi_name_index_clear( LibmsiNameIndex *index )
+{
+    msi_free( index->entries );
+    index->entries = NULL;
+    index->mask = 0;
+    index->count = 0;
+}
+
 GQuark
 libmsi_result_error_quark (void)
 {
@@ -209,13 +313,10 @@ unsigned msi_open_storage( LibmsiDatabase *db, const char *stname )
     LibmsiStorage *storage;
     GsfInput *in;
 
-    LIST_FOR_EACH_ENTRY( storage, &db->storages, LibmsiStorage, entry )
+    if (msi_name_index_find( &db->storage_index, stname ))
     {
-        if( !strcmp( stname, storage->name ) )
-        {
-            TRACE("found %s\n", debugstr_a(stname));
-            return r;
-        }
+        TRACE("found %s\n", debugstr_a(stname));
+        return r;
     }
 
     if (!(storage = msi_alloc_zero( sizeof(LibmsiStorage) ))) return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
@@ -231,6 +332,11 @@ unsigned msi_open_storage( LibmsiDatabase *db, const char *stname )
     if (!storage->stg)
         goto done;
 
+    if (!msi_name_index_add( &db->storage_index, storage->name, storage ))
+    {
+        g_object_unref(G_OBJECT(storage->stg));
+        goto done;
+    }
     list_add_tail( &db->storages, &storage->entry );
     r = LIBMSI_RESULT_SUCCESS;
 
@@ -253,14 +359,11 @@ unsigned msi_create_storage( LibmsiDatabase *db, const char *stname, GsfInput *s
     if (db->flags & LIBMSI_DB_FLAGS_READONLY)
         return LIBMSI_RESULT_ACCESS_DENIED;
 
-    LIST_FOR_EACH_ENTRY( storage, &db->storages, LibmsiStorage, entry )
+    storage = msi_name_index_find( &db->storage_index, stname );
+    if (storage)
     {
-        if( !strcmp( stname, storage->name ) )
-        {
-            TRACE("found %s\n", debugstr_a(stname));
-            found = true;
-            break;
-        }
+        TRACE("found %s\n", debugstr_a(stname));
+        found = true;
     }
 
     if (!found) {
@@ -281,6 +384,11 @@ unsigned msi_create_storage( LibmsiDatabase *db, const char *stname, GsfInput *s
         if (storage->stg)
             g_object_unref(G_OBJECT(storage->stg));
     } else {
+        if (!msi_name_index_add( &db->storage_index, storage->name, storage ))
+        {
+            r = LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+            goto done;
+        }
         list_add_tail( &db->storages, &storage->entry );
     }
 
@@ -305,34 +413,43 @@ done:
 
 void msi_destroy_storage( LibmsiDatabase *db, const char *stname )
 {
-    LibmsiStorage *storage, *storage2;
+    LibmsiStorage *storage;
 
-    LIST_FOR_EACH_ENTRY_SAFE( storage, storage2, &db->storages, LibmsiStorage, entry )
+    storage = msi_name_index_find( &db->storage_index, stname );
+    if (storage)
     {
-        if (!strcmp( stname, storage->name ))
-        {
-            TRACE("destroying %s\n", debugstr_a(stname));
+        TRACE("destroying %s\n", debugstr_a(stname));
 
-            list_remove( &storage->entry );
-            g_object_unref(G_OBJECT(storage->stg));
-            msi_free( storage );
-            break;
-        }
+        msi_name_index_remove( &db->storage_index, stname );
+        list_remove( &storage->entry );
+        g_object_unref(G_OBJECT(storage->stg));
+        msi_free( storage->name );
+        msi_free( storage );
+    }
+}
+
+static GsfInput *stream_input( LibmsiDatabase *db, LibmsiStream *stream )
+{
+    if (!stream->stm && db->infile)
+    {
+        TRACE("opening %s\n", debugstr_a(stream->name));
+        stream->stm = gsf_infile_child_by_name( db->infile, stream->name );
+        if (!stream->stm)
+            g_warning("failed to open stream %s\n", debugstr_a(stream->name));
     }
+    return stream->stm;
 }
 
 static unsigned find_infile_stream( LibmsiDatabase *db, const char *name, GsfInput **stm )
 {
     LibmsiStream *stream;
 
-    LIST_FOR_EACH_ENTRY( stream, &db->streams, LibmsiStream, entry )
+    stream = msi_name_index_find( &db->stream_index, name );
+    if (stream)
     {
-        if( !strcmp( name, stream->name ) )
-        {
-            TRACE("found %s\n", debugstr_a(name));
-            *stm = stream->stm;
-            return LIBMSI_RESULT_SUCCESS;
-        }
+        TRACE("found %s\n", debugstr_a(name));
+        *stm = stream_input( db, stream );
+        return *stm ? LIBMSI_RESULT_SUCCESS : LIBMSI_RESULT_FUNCTION_FAILED;
     }
 
     return LIBMSI_RESULT_FUNCTION_FAILED;
@@ -345,8 +462,15 @@ static unsigned msi_alloc_stream( LibmsiDatabase *db, const char *stname, GsfInp
     TRACE("%p %s %p", db, debugstr_a(stname), stm);
     if (!(stream = msi_alloc( sizeof(LibmsiStream) ))) return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
     stream->name = strdup( stname );
+    if (!stream->name || !msi_name_index_add( &db->stream_index, stream->name, stream ))
+    {
+        msi_free( stream->name );
+        msi_free( stream );
+        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+    }
     stream->stm = stm;
-    g_object_ref(G_OBJECT(stm));
+    if (stm)
+        g_object_ref(G_OBJECT(stm));
     list_add_tail( &db->streams, &stream->entry );
     return LIBMSI_RESULT_SUCCESS;
 }
@@ -357,19 +481,11 @@ unsigned write_raw_stream_data( LibmsiDatabase *db, const char *stname,
     unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
     GsfInput *stm = NULL;
     guint8 *mem;
-    LibmsiStream *stream;
 
     if (db->flags & LIBMSI_DB_FLAGS_READONLY)
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
-    LIST_FOR_EACH_ENTRY( stream, &db->streams, LibmsiStream, entry )
-    {
-        if( !strcmp( stname, stream->name ) )
-        {
-            msi_destroy_stream( db, stname );
-            break;
-        }
-    }
+    msi_destroy_stream( db, stname );
 
     mem = g_try_malloc(sz == 0 ? 1 : sz);
     if (!mem)
@@ -389,23 +505,14 @@ unsigned msi_create_stream( LibmsiDatabase *db, const char *stname, GsfInput *st
     LibmsiStream *stream;
     char *encname = NULL;
     unsigned r = LIBMSI_RESULT_FUNCTION_FAILED;
-    bool found = false;
 
     if (db->flags & LIBMSI_DB_FLAGS_READONLY)
         return LIBMSI_RESULT_ACCESS_DENIED;
 
     encname = encode_streamname(false, stname);
 
-    LIST_FOR_EACH_ENTRY( stream, &db->streams, LibmsiStream, entry )
-    {
-        if( !strcmp( encname, stream->name ) )
-        {
-            found = true;
-            break;
-        }
-    }
-
-    if (found) {
+    stream = msi_name_index_find( &db->stream_index, encname );
+    if (stream) {
         if (stream->stm)
             g_object_unref(G_OBJECT(stream->stm));
         stream->stm = stm;
@@ -418,7 +525,9 @@ unsigned msi_create_stream( LibmsiDatabase *db, const char *stname, GsfInput *st
     return r;
 }
 
-unsigned msi_enum_db_streams(LibmsiDatabase *db,
+/* If open is false, streams that have not been used yet are passed
+ * to fn as NULL rather than opened. */
+unsigned msi_enum_db_streams(LibmsiDatabase *db, bool open,
                              unsigned (*fn)(const char *, GsfInput *, void *),
                              void *opaque)
 {
@@ -429,10 +538,15 @@ unsigned msi_enum_db_streams(LibmsiDatabase *db,
     {
         GsfInput *stm;
 
-        stm = stream->stm;
-        g_object_ref(G_OBJECT(stm));
+        stm = open ? stream_input( db, stream ) : stream->stm;
+        if (open && !stm)
+            return LIBMSI_RESULT_FUNCTION_FAILED;
+
+        if (stm)
+            g_object_ref(G_OBJECT(stm));
         r = fn( stream->name, stm, opaque);
-        g_object_unref(G_OBJECT(stm));
+        if (stm)
+            g_object_unref(G_OBJECT(stm));
 
         if (r) {
             return r;
@@ -494,8 +608,11 @@ unsigned msi_get_raw_stream( LibmsiDatabase *db, const char *stname, GsfInput **
     g_autofree char *decoded = NULL;
     LibmsiTransform *transform;
 
-    decoded = decode_streamname(stname);
-    TRACE("%s -> %s\n", debugstr_a(stname), debugstr_a(decoded));
+    if (TRACE_ON)
+    {
+        decoded = decode_streamname(stname);
+        TRACE("%s -> %s\n", debugstr_a(stname), debugstr_a(decoded));
+    }
 
     if (clone_infile_stream( db, stname, stm ) == LIBMSI_RESULT_SUCCESS)
         return LIBMSI_RESULT_SUCCESS;
@@ -515,24 +632,25 @@ unsigned msi_get_raw_stream( LibmsiDatabase *db, const char *stname, GsfInput **
 
 void msi_destroy_stream( LibmsiDatabase *db, const char *stname )
 {
-    LibmsiStream *stream, *stream2;
+    LibmsiStream *stream;
 
-    LIST_FOR_EACH_ENTRY_SAFE( stream, stream2, &db->streams, LibmsiStream, entry )
+    stream = msi_name_index_find( &db->stream_index, stname );
+    if (stream)
     {
-        if (!strcmp( stname, stream->name ))
-        {
-            TRACE("destroying %s\n", debugstr_a(stname));
+        TRACE("destroying %s\n", debugstr_a(stname));
 
-            list_remove( &stream->entry );
+        msi_name_index_remove( &db->stream_index, stname );
+        list_remove( &stream->entry );
+        if (stream->stm)
             g_object_unref(G_OBJECT(stream->stm));
-            msi_free( stream );
-            break;
-        }
+        msi_free( stream->name );
+        msi_free( stream );
     }
 }
 
 static void free_storages( LibmsiDatabase *db )
 {
+    msi_name_index_clear( &db->storage_index );
     while( !list_empty( &db->storages ) )
     {
         LibmsiStorage *s = LIST_ENTRY(list_head( &db->storages ), LibmsiStorage, entry);
@@ -545,11 +663,13 @@ static void free_storages( LibmsiDatabase *db )
 
 static void free_streams( LibmsiDatabase *db )
 {
+    msi_name_index_clear( &db->stream_index );
     while( !list_empty( &db->streams ) )
     {
         LibmsiStream *s = LIST_ENTRY(list_head( &db->streams ), LibmsiStream, entry);
         list_remove( &s->entry );
-        g_object_unref(G_OBJECT(s->stm));
+        if (s->stm)
+            g_object_unref(G_OBJECT(s->stm));
         msi_free( s->name );
         msi_free( s );
     }
@@ -582,6 +702,8 @@ LibmsiResult _libmsi_database_close(LibmsiDatabase *db, bool committed)
         msi_destroy_stringtable( db->strings);
         db->strings = NULL;
     }
+    msi_free( db->string_ids );
+    db->string_ids = NULL;
 
     if ( db->infile )
     {
@@ -2119,11 +2241,13 @@ static void cache_infile_structure( LibmsiDatabase *db )
     for (i = 0; i < n; i++)
     {
         GsfInput *in = gsf_infile_child_by_index(db->infile, i);
-        const char* name = gsf_input_name(in);
+        const char* name = in ? gsf_input_name(in) : NULL;
         const uint8_t *name8 = (const uint8_t *)name;
 
         if (!name) {
             g_warn_if_reached();
+            if (in)
+                g_object_unref(G_OBJECT(in));
             continue;
         }
         /* table streams are not in the _Streams table */
@@ -2134,22 +2258,23 @@ static void cache_infile_structure( LibmsiDatabase *db )
                 g_autofree char *decname = NULL;
 
                 decname = decode_streamname(name + 3);
-                if ( !strcmp( decname, szStringPool ) ||
-                     !strcmp( decname, szStringData ) )
-                    continue;
-
-                r = _libmsi_open_table( db, decname, false );
-                g_warn_if_fail (r == LIBMSI_RESULT_SUCCESS);
+                if ( strcmp( decname, szStringPool ) &&
+                     strcmp( decname, szStringData ) )
+                {
+                    r = _libmsi_open_table( db, decname, false );
+                    g_warn_if_fail (r == LIBMSI_RESULT_SUCCESS);
+                }
             }
             else
             {
-                r = msi_alloc_stream(db, name, GSF_INPUT(in));
-                g_object_unref(G_OBJECT(in));
+                /* only remember the name, the stream is opened again
+                 * when it is first used */
+                r = msi_alloc_stream(db, name, NULL);
             }
         } else {
             msi_open_storage(db, name);
         }
-
+        g_object_unref(G_OBJECT(in));
     }
 }
 
@@ -2162,7 +2287,18 @@ LibmsiResult _libmsi_database_open(LibmsiDatabase *db)
 
     TRACE("%p %s\n", db, db->path);
 
-    in = gsf_input_stdio_new(db->path, NULL);
+    /* a read-only database is never rewritten under us, so map it and
+     * let the tables and the string pool be decoded straight from the
+     * mapping instead of being copied through stdio buffers */
+    in = NULL;
+    db->mapped = false;
+    if (db->flags & LIBMSI_DB_FLAGS_READONLY)
+    {
+        in = gsf_input_mmap_new(db->path, NULL);
+        db->mapped = in != NULL;
+    }
+    if (!in)
+        in = gsf_input_stdio_new(db->path, NULL);
     if (!in)
     {
         g_warning("open file failed for %s\n", debugstr_a(db->path));
@@ -2203,7 +2339,7 @@ LibmsiResult _libmsi_database_open(LibmsiDatabase *db)
 
     cache_infile_structure( db );
 
-    db->strings = msi_load_string_table( db->infile, &db->bytes_per_strref );
+    db->strings = msi_load_string_table( db->infile, db->mapped, &db->bytes_per_strref );
     if( !db->strings )
         goto end;
 
@@ -2303,7 +2439,7 @@ static int gsf_infile_copy(GsfInfile *inf, GsfOutfile *outf)
         if (is_dir)
             ok = gsf_infile_copy(childf, GSF_OUTFILE(dest));
         else
-            ok = gsf_input_copy(child, dest);
+            ok = copy_stream_data(child, dest);
 
         g_object_unref(G_OBJECT(child));
         g_object_unref(G_OBJECT(dest));
@@ -2343,16 +2479,18 @@ static unsigned commit_stream( const char *name, GsfInput *stm, void *opaque)
     unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
     g_autofree char *decname = NULL;
 
-    decname = decode_streamname(name);
-    TRACE("%s(%s) %p %p\n", debugstr_a(name), debugstr_a(decname), stm, opaque);
+    if (TRACE_ON)
+    {
+        decname = decode_streamname(name);
+        TRACE("%s(%s) %p %p\n", debugstr_a(name), debugstr_a(decname), stm, opaque);
+    }
 
     outstm = gsf_outfile_new_child( db->outfile, name, false );
     if ( !outstm )
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
-    gsf_input_seek (stm, 0, G_SEEK_SET);
     gsf_output_seek (outstm, 0, G_SEEK_SET);
-    if ( !gsf_input_copy( stm, outstm ))
+    if ( !copy_stream_data( stm, outstm ))
         goto end;
 
     ret = LIBMSI_RESULT_SUCCESS;
@@ -2363,18 +2501,146 @@ end:
     return ret;
 }
 
+/* The string table, the tables and the lists of streams and storages are
+ * kept in memory across a commit.  Only the handles into the old file are
+ * dropped, and the streams and storages are reattached to the file that
+ * was just written, which has all of them under the same names. */
+static unsigned rebind_committed_file( LibmsiDatabase *db )
+{
+    LibmsiStream *stream, *stream2;
+    LibmsiStorage *storage, *storage2;
+    unsigned ret = LIBMSI_RESULT_SUCCESS;
+    GsfInput *in;
+    GsfInfile *stg;
+
+    TRACE("%p\n", db);
+
+    LIST_FOR_EACH_ENTRY( stream, &db->streams, LibmsiStream, entry )
+    {
+        if (stream->stm)
+            g_object_unref(G_OBJECT(stream->stm));
+        stream->stm = NULL;
+    }
+    LIST_FOR_EACH_ENTRY( storage, &db->storages, LibmsiStorage, entry )
+    {
+        g_object_unref(G_OBJECT(storage->stg));
+        storage->stg = NULL;
+    }
+
+    if ( db->infile )
+    {
+        g_object_unref(G_OBJECT(db->infile));
+        db->infile = NULL;
+    }
+
+    gsf_output_close(GSF_OUTPUT(db->outfile));
+    g_object_unref(G_OBJECT(db->outfile));
+    db->outfile = NULL;
+
+    if (db->rename_outpath) {
+        unlink(db->path);
+        rename(db->outpath, db->path);
+        msi_free( db->outpath );
+    } else {
+        msi_free( db->path );
+        db->path = db->outpath;
+    }
+    db->outpath = NULL;
+
+    in = gsf_input_stdio_new(db->path, NULL);
+    if (!in)
+    {
+        g_warning("open file failed for %s\n", debugstr_a(db->path));
+        ret = LIBMSI_RESULT_OPEN_FAILED;
+        goto end;
+    }
+    stg = gsf_infile_msole_new( in, NULL );
+    g_object_unref(G_OBJECT(in));
+    if (!stg)
+    {
+        g_warning("open failed for %s\n", debugstr_a(db->path));
+        ret = LIBMSI_RESULT_OPEN_FAILED;
+        goto end;
+    }
+    db->infile = stg;
+
+end:
+    /* the streams are opened again when they are next used */
+    LIST_FOR_EACH_ENTRY_SAFE( stream, stream2, &db->streams, LibmsiStream, entry )
+    {
+        if (!db->infile)
+        {
+            g_warning("lost stream %s\n", debugstr_a(stream->name));
+            msi_name_index_remove( &db->stream_index, stream->name );
+            list_remove( &stream->entry );
+            msi_free( stream->name );
+            msi_free( stream );
+            ret = LIBMSI_RESULT_OPEN_FAILED;
+        }
+    }
+    LIST_FOR_EACH_ENTRY_SAFE( storage, storage2, &db->storages, LibmsiStorage, entry )
+    {
+        in = db->infile ? gsf_infile_child_by_name(db->infile, storage->name) : NULL;
+        if (in && GSF_IS_INFILE(in))
+            storage->stg = GSF_INFILE(in);
+        else
+        {
+            g_warning("lost storage %s\n", debugstr_a(storage->name));
+            if (in)
+                g_object_unref(G_OBJECT(in));
+            msi_name_index_remove( &db->storage_index, storage->name );
+            list_remove( &storage->entry );
+            msi_free( storage->name );
+            msi_free( storage );
+            ret = LIBMSI_RESULT_OPEN_FAILED;
+        }
+    }
+    return ret;
+}
+
+/* after a compacting commit, remember the id in the string table of each
+ * string id of the committed file; tables read from the file later are
+ * given the ids of their strings in memory */
+static unsigned set_committed_string_ids (LibmsiDatabase *db, const unsigned *map, unsigned count)
+{
+    unsigned *ids = NULL;
+    unsigned n, size = 0;
+
+    if (map) {
+        for (n = 1; n < count; n++)
+            size = MAX (size, map[n] + 1);
+        ids = msi_alloc_zero (size * sizeof(unsigned));
+        if (!ids)
+            return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+        for (n = 1; n < count; n++)
+            if (map[n])
+                ids[map[n]] = n;
+    }
+
+    msi_free (db->string_ids);
+    db->string_ids = ids;
+    db->string_id_count = size;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 /**
  * libmsi_database_commit:
  * @db: a #LibmsiDatabase
  * @error: (allow-none): #GError to set on error, or %NULL
  *
+ * If @db was opened with %LIBMSI_DB_FLAGS_COMPACT, strings that no saved
+ * row refers to are left out of the string pool and the others are
+ * numbered consecutively.  The pool is saved as it is if a table can't be
+ * loaded, since the strings of that table can't be renumbered.
+ *
  * Returns: %TRUE on success.
  **/
 gboolean
 libmsi_database_commit (LibmsiDatabase *db, GError **error)
 {
     unsigned r = LIBMSI_RESULT_SUCCESS;
-    unsigned bytes_per_strref;
+    unsigned bytes_per_strref, count = 0;
+    unsigned *refs = NULL, *map = NULL;
 
     TRACE ("%p\n", db);
 
@@ -2387,7 +2653,30 @@ libmsi_database_commit (LibmsiDatabase *db, GError **error)
 
     /* FIXME: lock the database */
 
-    r = msi_save_string_table (db->strings, db, &bytes_per_strref);
+    if (db->flags & LIBMSI_DB_FLAGS_COMPACT) {
+        count = msi_get_string_table_count (db->strings);
+        refs = msi_alloc_zero (count * sizeof(unsigned));
+        map = msi_alloc (count * sizeof(unsigned));
+        if (!refs || !map)
+            r = LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+        else
+            r = _libmsi_database_count_string_refs (db, refs, count);
+        if (r == LIBMSI_RESULT_NOT_ENOUGH_MEMORY) {
+            g_set_error (error, LIBMSI_RESULT_ERROR, r,
+                         "failed to count string references r=%08x\n", r);
+            goto end;
+        }
+        if (r != LIBMSI_RESULT_SUCCESS) {
+            /* commit the way an unmodified table is copied, unchanged */
+            g_warning ("not compacting the string pool r=%08x\n", r);
+            msi_free (refs);
+            msi_free (map);
+            refs = map = NULL;
+            r = LIBMSI_RESULT_SUCCESS;
+        }
+    }
+
+    r = msi_save_string_table (db->strings, db, refs, map, &bytes_per_strref);
     if (r != LIBMSI_RESULT_SUCCESS) {
         g_set_error (error, LIBMSI_RESULT_ERROR, r,
                      "failed to save string table r=%08x\n", r);
@@ -2401,31 +2690,44 @@ libmsi_database_commit (LibmsiDatabase *db, GError **error)
         goto end;
     }
 
-    r = msi_enum_db_streams (db, commit_stream, db);
+    r = msi_enum_db_streams (db, true, commit_stream, db);
     if (r != LIBMSI_RESULT_SUCCESS) {
         g_set_error (error, LIBMSI_RESULT_ERROR, r,
                      "failed to save streams r=%08x\n", r);
         goto end;
     }
 
-    r = _libmsi_database_commit_tables (db, bytes_per_strref);
+    r = _libmsi_database_commit_tables (db, bytes_per_strref, map);
     if (r != LIBMSI_RESULT_SUCCESS) {
         g_set_error (error, LIBMSI_RESULT_ERROR, r,
                      "failed to save tables r=%08x\n", r);
         goto end;
     }
 
+    r = set_committed_string_ids (db, map, count);
+    if (r != LIBMSI_RESULT_SUCCESS) {
+        g_set_error (error, LIBMSI_RESULT_ERROR, r,
+                     "failed to save tables r=%08x\n", r);
+        goto end;
+    }
     db->bytes_per_strref = bytes_per_strref;
 
     /* FIXME: unlock the database */
 
-    _libmsi_database_close(db, true);
+    r = rebind_committed_file (db);
+    if (r != LIBMSI_RESULT_SUCCESS) {
+        g_set_error (error, LIBMSI_RESULT_ERROR, r,
+                     "failed to reopen committed database r=%08x\n", r);
+        goto end;
+    }
+
     db->flags &= ~LIBMSI_DB_FLAGS_CREATE;
     db->flags |= LIBMSI_DB_FLAGS_TRANSACT;
-    _libmsi_database_open(db);
     _libmsi_database_start_transaction(db);
 
 end:
+    msi_free(refs);
+    msi_free(map);
     g_object_unref(db);
 
     return r == LIBMSI_RESULT_SUCCESS;
@@ -282,21 +282,37 @@ LibmsiRecord *_libmsi_query_get_record( LibmsiDatabase *db, const char *fmt, ...
     return rec;
 }
 
+unsigned msi_view_seek(LibmsiView *view, unsigned row)
+{
+    unsigned row_count = 0, ret;
+
+    if (view->ops->seek)
+        return view->ops->seek(view, row);
+
+    ret = view->ops->get_dimensions(view, &row_count, NULL);
+    if (ret)
+        return ret;
+
+    return row < row_count ? LIBMSI_RESULT_SUCCESS : NO_MORE_ITEMS;
+}
+
 unsigned msi_view_get_row(LibmsiDatabase *db, LibmsiView *view, unsigned row, LibmsiRecord **rec)
 {
-    unsigned row_count = 0, col_count = 0, i, ival, ret, type;
+    unsigned col_count = 0, i, ival, ret, type;
 
     TRACE("%p %p %d %p\n", db, view, row, rec);
 
-    ret = view->ops->get_dimensions(view, &row_count, &col_count);
+    ret = view->ops->get_dimensions(view, NULL, &col_count);
     if (ret)
         return ret;
 
     if (!col_count)
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
-    if (row >= row_count)
-        return NO_MORE_ITEMS;
+    /* only the rows up to this one need to be found */
+    ret = msi_view_seek(view, row);
+    if (ret)
+        return ret;
 
     *rec = libmsi_record_new (col_count);
     if (!*rec)
@@ -360,6 +376,27 @@ unsigned msi_view_get_row(LibmsiDatabase *db, LibmsiView *view, unsigned row, Li
     return LIBMSI_RESULT_SUCCESS;
 }
 
+unsigned msi_view_explain(LibmsiView *view, GString *plan)
+{
+    const char *name;
+    unsigned r, rows;
+
+    if (view->ops->explain)
+        return view->ops->explain(view, plan);
+
+    /* anything else reads all the rows of a single table */
+    r = view->ops->get_column_info(view, 1, NULL, NULL, NULL, &name);
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return LIBMSI_RESULT_CALL_NOT_IMPLEMENTED;
+
+    r = view->ops->get_dimensions(view, &rows, NULL);
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
+    g_string_append_printf(plan, "SCAN %s (~%u rows)\n", name, rows);
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 LibmsiResult _libmsi_query_fetch(LibmsiQuery *query, LibmsiRecord **prec)
 {
     LibmsiView *view;
@@ -617,6 +654,43 @@ libmsi_query_get_column_info (LibmsiQuery *query, LibmsiColInfo info, GError **e
     return rec;
 }
 
+/**
+ * libmsi_query_explain:
+ * @query: a #LibmsiQuery
+ * @error: (allow-none): return location for the error
+ *
+ * Describe how the @query finds its rows: one line per table, in
+ * the order they are joined, giving whether the table is scanned,
+ * looked up in an index or hashed, and the estimated number of rows
+ * found so far.  The query does not need to be executed first.
+ *
+ * Returns: (transfer full): a newly allocated string or %NULL on error.
+ **/
+gchar *
+libmsi_query_explain (LibmsiQuery *query, GError **error)
+{
+    GString *plan;
+    unsigned r;
+
+    TRACE("%p\n", query);
+
+    g_return_val_if_fail (LIBMSI_IS_QUERY (query), NULL);
+    g_return_val_if_fail (!error || *error == NULL, NULL);
+
+    plan = g_string_new (NULL);
+    g_object_ref(query);
+    r = msi_view_explain( query->view, plan );
+    g_object_unref(query);
+
+    if (r != LIBMSI_RESULT_SUCCESS) {
+        g_set_error_literal (error, LIBMSI_RESULT_ERROR, r, G_STRFUNC);
+        g_string_free (plan, TRUE);
+        return NULL;
+    }
+
+    return g_string_free (plan, FALSE);
+}
+
 /**
  * libmsi_query_get_error:
  * @query: a #LibmsiQuery
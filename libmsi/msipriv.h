@@ -72,6 +72,11 @@ typedef enum LibmsiCondition
 #define MAX_STREAM_NAME_LEN     62
 #define LONG_STR_BYTES  3
 
+/* streams are produced in pieces of this size when committing */
+#define MSI_WRITE_CHUNK_SIZE 0x10000
+/* and copied in blocks of this size */
+#define MSI_COPY_BLOCK_SIZE 0x100000
+
 #define NO_MORE_ITEMS G_MAXINT
 
 #define MSITYPE_IS_BINARY(type) (((type) & ~MSITYPE_NULLABLE) == (MSITYPE_STRING|MSITYPE_VALID))
@@ -85,6 +90,22 @@ typedef struct string_table string_table;
 #define MSI_INITIAL_MEDIA_TRANSFORM_OFFSET 10000
 #define MSI_INITIAL_MEDIA_TRANSFORM_DISKID 30000
 
+typedef struct _LibmsiNameIndexEntry
+{
+    unsigned hash;
+    const char *name;
+    void *value;
+} LibmsiNameIndexEntry;
+
+/* open addressing index from names to values, using linear probing.  The
+ * names are not copied and must stay valid while they are in the index. */
+typedef struct _LibmsiNameIndex
+{
+    unsigned mask;
+    unsigned count;
+    LibmsiNameIndexEntry *entries;
+} LibmsiNameIndex;
+
 struct _LibmsiDatabase
 {
     GObject parent;
@@ -93,9 +114,13 @@ struct _LibmsiDatabase
     GsfOutfile *outfile;
     string_table *strings;
     unsigned bytes_per_strref;
+    unsigned *string_ids;      /* the id in strings of each string id of the
+                                * file, if a compacting commit renumbered them */
+    unsigned string_id_count;
     char *path;
     char *outpath;
     bool rename_outpath;
+    bool mapped;
     guint flags;
     unsigned media_transform_offset;
     unsigned media_transform_disk_id;
@@ -103,6 +128,8 @@ struct _LibmsiDatabase
     struct list transforms;
     struct list streams;
     struct list storages;
+    LibmsiNameIndex stream_index;
+    LibmsiNameIndex storage_index;
 };
 
 typedef struct _LibmsiView LibmsiView;
@@ -235,6 +262,9 @@ typedef struct _LibmsiViewOps
      * The handle is an input/output parameter that keeps track of the current
      *  position in the iteration. It must be initialised to zero before the
      *  first call and continued to be passed in to subsequent calls.
+     * The matching rows are returned in no particular order. The table view
+     *  returns them in the probe order of its hash index, which is only
+     *  ascending until rows are inserted or updated after it was built.
      */
     unsigned (*find_matching_rows)( LibmsiView *view, unsigned col, unsigned val, unsigned *row, MSIITERHANDLE *handle );
 
@@ -267,6 +297,24 @@ typedef struct _LibmsiViewOps
      * drop - drops the table from the database
      */
     unsigned (*drop)( LibmsiView *view );
+
+    /*
+     * explain - describes how the view will find its rows
+     *
+     * One line per table is appended to the plan, in the order the tables
+     *  are joined, giving how its rows are found and the estimated number
+     *  of row combinations after joining it.
+     */
+    unsigned (*explain)( LibmsiView *view, GString *plan );
+
+    /*
+     * seek - checks that a row exists, returning NO_MORE_ITEMS if it does not
+     *
+     * Views that find their rows as they are fetched only look as far as
+     *  the requested row.  Without it, the row is checked against the row
+     *  count from get_dimensions.
+     */
+    unsigned (*seek)( LibmsiView *view, unsigned row );
 } LibmsiViewOps;
 
 struct _LibmsiView
@@ -333,7 +381,8 @@ typedef struct {
 unsigned msi_strcpy_to_awstring( const char *str, awstring *awbuf, unsigned *sz );
 
 extern void free_cached_tables( LibmsiDatabase *db );
-extern unsigned _libmsi_database_commit_tables( LibmsiDatabase *db, unsigned bytes_per_strref );
+extern unsigned _libmsi_database_commit_tables( LibmsiDatabase *db, unsigned bytes_per_strref, const unsigned *map );
+extern unsigned _libmsi_database_count_string_refs( LibmsiDatabase *db, unsigned *refs, unsigned count );
 
 
 /* string table functions */
@@ -347,9 +396,12 @@ extern int _libmsi_add_string( string_table *st, const char *data, int len, uint
 extern unsigned _libmsi_id_from_string_utf8( const string_table *st, const char *buffer, unsigned *id );
 extern void msi_destroy_stringtable( string_table *st );
 extern const char *msi_string_lookup_id( const string_table *st, unsigned id );
+extern bool msi_string_has_duplicates( const string_table *st );
+extern unsigned msi_string_first_id( const string_table *st, unsigned id );
 extern string_table *msi_init_string_table( unsigned *bytes_per_strref );
-extern string_table *msi_load_string_table( GsfInfile *stg, unsigned *bytes_per_strref );
-extern unsigned msi_save_string_table( const string_table *st, LibmsiDatabase *db, unsigned *bytes_per_strref );
+extern string_table *msi_load_string_table( GsfInfile *stg, bool mapped, unsigned *bytes_per_strref );
+extern unsigned msi_save_string_table( string_table *st, LibmsiDatabase *db, const unsigned *refs, unsigned *map, unsigned *bytes_per_strref );
+extern unsigned msi_get_string_table_count( const string_table *st );
 extern unsigned msi_get_string_table_codepage( const string_table *st );
 extern unsigned msi_set_string_table_codepage( string_table *st, unsigned codepage );
 
@@ -359,8 +411,12 @@ extern LibmsiCondition _libmsi_database_is_table_persistent( LibmsiDatabase *db,
 
 extern unsigned read_stream_data( GsfInfile *stg, const char *stname,
                               uint8_t **pdata, unsigned *psz );
+extern unsigned map_stream_data( GsfInfile *stg, const char *stname,
+                                 const uint8_t **pdata, unsigned *psz, GsfInput **pstm );
+extern GsfOutput *create_stream_output( LibmsiDatabase *db, const char *stname );
 extern unsigned write_stream_data( LibmsiDatabase *db, const char *stname,
                                const void *data, unsigned sz );
+extern bool copy_stream_data( GsfInput *in, GsfOutput *out );
 extern unsigned write_raw_stream_data( LibmsiDatabase *db, const char *stname,
                         const void *data, unsigned sz, GsfInput **outstm );
 extern unsigned _libmsi_database_commit_streams( LibmsiDatabase *db );
@@ -390,15 +446,21 @@ extern bool _libmsi_record_compare_fields(const LibmsiRecord *a, const LibmsiRec
 extern void enum_stream_names( GsfInfile *stg );
 extern char *encode_streamname(bool bTable, const char *in);
 extern char *decode_streamname(const char *in);
+extern bool encode_streamname_buf(bool bTable, const char *name, char *out, size_t size);
+extern bool decode_streamname_buf(const char *in, char *out, size_t size);
 
 /* database internals */
 extern LibmsiResult _libmsi_database_start_transaction(LibmsiDatabase *db);
 extern LibmsiResult _libmsi_database_open(LibmsiDatabase *db);
 extern LibmsiResult _libmsi_database_close(LibmsiDatabase *db, bool committed);
+extern bool msi_name_index_add( LibmsiNameIndex *index, const char *name, void *value );
+extern void *msi_name_index_find( const LibmsiNameIndex *index, const char *name );
+extern void msi_name_index_remove( LibmsiNameIndex *index, const char *name );
+extern void msi_name_index_clear( LibmsiNameIndex *index );
 unsigned msi_create_stream( LibmsiDatabase *db, const char *stname, GsfInput *stm );
 extern unsigned msi_get_raw_stream( LibmsiDatabase *, const char *, GsfInput **);
 void msi_destroy_stream( LibmsiDatabase *, const char * );
-extern unsigned msi_enum_db_streams(LibmsiDatabase *, unsigned (*fn)(const char *, GsfInput *, void *), void *);
+extern unsigned msi_enum_db_streams(LibmsiDatabase *, bool, unsigned (*fn)(const char *, GsfInput *, void *), void *);
 unsigned msi_create_storage( LibmsiDatabase *db, const char *stname, GsfInput *stm );
 unsigned msi_open_storage( LibmsiDatabase *db, const char *stname );
 void msi_destroy_storage( LibmsiDatabase *db, const char *stname );
@@ -416,6 +478,8 @@ extern unsigned _libmsi_query_fetch( LibmsiQuery*, LibmsiRecord ** );
 extern unsigned _libmsi_query_get_column_info(LibmsiQuery *, LibmsiColInfo, LibmsiRecord **);
 extern unsigned _libmsi_view_find_column( LibmsiView *, const char *, const char *, unsigned *);
 extern unsigned msi_view_get_row(LibmsiDatabase *, LibmsiView *, unsigned, LibmsiRecord **);
+extern unsigned msi_view_explain(LibmsiView *, GString *);
+extern unsigned msi_view_seek(LibmsiView *, unsigned);
 
 /* summary information */
 extern unsigned msi_add_suminfo( LibmsiDatabase *db, char ***records, int num_records, int num_columns );
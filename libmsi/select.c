@@ -267,6 +267,30 @@ static unsigned select_view_find_matching_rows( LibmsiView *view, unsigned col,
     return sv->table->ops->find_matching_rows( sv->table, col, val, row, handle );
 }
 
+static unsigned select_view_explain( LibmsiView *view, GString *plan )
+{
+    LibmsiSelectView *sv = (LibmsiSelectView*)view;
+
+    TRACE("%p %p\n", sv, plan);
+
+    if( !sv->table )
+         return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return msi_view_explain( sv->table, plan );
+}
+
+static unsigned select_view_seek( LibmsiView *view, unsigned row )
+{
+    LibmsiSelectView *sv = (LibmsiSelectView*)view;
+
+    TRACE("%p %d\n", sv, row);
+
+    if( !sv->table )
+         return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return msi_view_seek( sv->table, row );
+}
+
 
 static const LibmsiViewOps select_ops =
 {
@@ -288,6 +312,8 @@ static const LibmsiViewOps select_ops =
     NULL,
     NULL,
     NULL,
+    select_view_explain,
+    select_view_seek,
 };
 
 static unsigned select_view_add_column( LibmsiSelectView *sv, const char *name,
@@ -278,7 +278,7 @@ static unsigned storages_view_find_matching_rows(LibmsiView *view, unsigned col,
 
     TRACE("(%d, %d): %d\n", *row, col, val);
 
-    if (col == 0 || col > NUM_STORAGES_COLS)
+    if (col != 1)
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
     while (index < sv->num_rows)
@@ -293,7 +293,7 @@ static unsigned storages_view_find_matching_rows(LibmsiView *view, unsigned col,
     }
 
     *handle = (MSIITERHANDLE)(uintptr_t)++index;
-    if (index >= sv->num_rows)
+    if (index > sv->num_rows)
         return NO_MORE_ITEMS;
 
     return LIBMSI_RESULT_SUCCESS;
@@ -319,6 +319,8 @@ static const LibmsiViewOps storages_ops =
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
 };
 
 static unsigned add_storage_to_table(const char *name, GsfInfile *stg, void *opaque)
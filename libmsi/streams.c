@@ -29,9 +29,13 @@
 
 #define NUM_STREAMS_COLS    2
 
+/* Rows keep the encoded name of their stream.  For the streams of the
+ * database it is only added to the string table when first needed, and
+ * the stream is opened when first fetched. */
 typedef struct tabSTREAM
 {
     unsigned str_index;
+    char *name;
     GsfInput *stream;
 } STREAM;
 
@@ -43,6 +47,9 @@ typedef struct _LibmsiStreamsView
     unsigned max_streams;
     unsigned num_rows;
     unsigned row_size;
+    /* row + 1 of each encoded name, built on the first lookup by name */
+    LibmsiNameIndex index;
+    bool indexed;
 } LibmsiStreamsView;
 
 static bool streams_set_table_size(LibmsiStreamsView *sv, unsigned size)
@@ -62,20 +69,20 @@ static bool streams_set_table_size(LibmsiStreamsView *sv, unsigned size)
 static STREAM *create_stream(LibmsiStreamsView *sv, const char *name, bool encoded, GsfInput *stm)
 {
     STREAM *stream;
-    g_autofree char *decoded = NULL;
 
-    stream = msi_alloc(sizeof(STREAM));
+    stream = msi_alloc_zero(sizeof(STREAM));
     if (!stream)
         return NULL;
 
-    if (encoded)
+    stream->name = encoded ? strdup(name) : encode_streamname(false, name);
+    if (!stream->name)
     {
-        decoded = decode_streamname(name);
-        TRACE("stream -> %s %s\n", debugstr_a(name), debugstr_a(decoded));
-        name = decoded;
+        msi_free(stream);
+        return NULL;
     }
+    if (!encoded)
+        stream->str_index = _libmsi_add_string(sv->db->strings, name, -1, 1, StringNonPersistent);
 
-    stream->str_index = _libmsi_add_string(sv->db->strings, name, -1, 1, StringNonPersistent);
     stream->stream = stm;
     if (stream->stream)
         g_object_ref(G_OBJECT(stm));
@@ -83,6 +90,28 @@ static STREAM *create_stream(LibmsiStreamsView *sv, const char *name, bool encod
     return stream;
 }
 
+static void free_stream(STREAM *stream)
+{
+    if (stream->stream)
+        g_object_unref(G_OBJECT(stream->stream));
+    msi_free(stream->name);
+    msi_free(stream);
+}
+
+/* add the stream's name to the string table on first use */
+static unsigned stream_str_index(LibmsiStreamsView *sv, STREAM *stream)
+{
+    g_autofree char *decoded = NULL;
+
+    if (!stream->str_index)
+    {
+        decoded = decode_streamname(stream->name);
+        TRACE("stream -> %s %s\n", debugstr_a(stream->name), debugstr_a(decoded));
+        stream->str_index = _libmsi_add_string(sv->db->strings, decoded, -1, 1, StringNonPersistent);
+    }
+    return stream->str_index;
+}
+
 static unsigned streams_view_fetch_int(LibmsiView *view, unsigned row, unsigned col, unsigned *val)
 {
     LibmsiStreamsView *sv = (LibmsiStreamsView *)view;
@@ -95,7 +124,7 @@ static unsigned streams_view_fetch_int(LibmsiView *view, unsigned row, unsigned
     if (row >= sv->num_rows)
         return NO_MORE_ITEMS;
 
-    *val = sv->streams[row]->str_index;
+    *val = stream_str_index(sv, sv->streams[row]);
 
     return LIBMSI_RESULT_SUCCESS;
 }
@@ -109,6 +138,10 @@ static unsigned streams_view_fetch_stream(LibmsiView *view, unsigned row, unsign
     if (row >= sv->num_rows)
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
+    if (!sv->streams[row]->stream &&
+        msi_get_raw_stream(sv->db, sv->streams[row]->name, &sv->streams[row]->stream) != LIBMSI_RESULT_SUCCESS)
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
     g_object_ref(G_OBJECT(sv->streams[row]->stream));
     *stm = sv->streams[row]->stream;
 
@@ -137,6 +170,9 @@ static unsigned streams_view_set_row(LibmsiView *view, unsigned row, LibmsiRecor
     if (row > sv->num_rows)
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
+    msi_name_index_clear(&sv->index);
+    sv->indexed = false;
+
     r = _libmsi_record_get_gsf_input(rec, 2, &stm);
     if (r != LIBMSI_RESULT_SUCCESS)
         return r;
@@ -148,7 +184,7 @@ static unsigned streams_view_set_row(LibmsiView *view, unsigned row, LibmsiRecor
         }
 
         stream = sv->streams[row];
-        name = strdup(msi_string_lookup_id(sv->db->strings, stream->str_index));
+        name = strdup(msi_string_lookup_id(sv->db->strings, stream_str_index(sv, stream)));
     } else {
         name = strdup(_libmsi_record_get_string_raw(rec, 1));
         if (!name)
@@ -167,8 +203,7 @@ static unsigned streams_view_set_row(LibmsiView *view, unsigned row, LibmsiRecor
     if (r != LIBMSI_RESULT_SUCCESS)
     {
         g_warning("failed to create stream: %08x\n", r);
-        g_object_unref(G_OBJECT(stream->stream));
-        msi_free(stream);
+        free_stream(stream);
         goto done;
     }
 
@@ -214,7 +249,7 @@ static unsigned streams_view_delete_row(LibmsiView *view, unsigned row)
     if (row > sv->num_rows)
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
-    name = msi_string_lookup_id(sv->db->strings, sv->streams[row]->str_index);
+    name = msi_string_lookup_id(sv->db->strings, stream_str_index(sv, sv->streams[row]));
     if (!name)
     {
         g_warning("failed to retrieve stream name\n");
@@ -223,6 +258,10 @@ static unsigned streams_view_delete_row(LibmsiView *view, unsigned row)
 
     encname = encode_streamname(false, name);
     msi_destroy_stream(sv->db, encname);
+    msi_free(encname);
+
+    msi_name_index_clear(&sv->index);
+    sv->indexed = false;
 
     /* shift the remaining rows */
     for (i = row + 1; i < sv->num_rows; i++)
@@ -297,19 +336,33 @@ static unsigned streams_view_delete(LibmsiView *view)
     for (i = 0; i < sv->num_rows; i++)
     {
         if (sv->streams[i])
-        {
-            if (sv->streams[i]->stream)
-                g_object_unref(G_OBJECT(sv->streams[i]->stream));
-            msi_free(sv->streams[i]);
-        }
+            free_stream(sv->streams[i]);
     }
 
+    msi_name_index_clear(&sv->index);
     msi_free(sv->streams);
     msi_free(sv);
 
     return LIBMSI_RESULT_SUCCESS;
 }
 
+static bool streams_build_index(LibmsiStreamsView *sv)
+{
+    unsigned i;
+
+    for (i = 0; i < sv->num_rows; i++)
+    {
+        if (sv->streams[i] && !msi_name_index_find(&sv->index, sv->streams[i]->name) &&
+            !msi_name_index_add(&sv->index, sv->streams[i]->name, (void *)(uintptr_t)(i + 1)))
+        {
+            msi_name_index_clear(&sv->index);
+            return false;
+        }
+    }
+    sv->indexed = true;
+    return true;
+}
+
 static unsigned streams_view_find_matching_rows(LibmsiView *view, unsigned col,
                                        unsigned val, unsigned *row, MSIITERHANDLE *handle)
 {
@@ -321,9 +374,35 @@ static unsigned streams_view_find_matching_rows(LibmsiView *view, unsigned col,
     if (col == 0 || col > NUM_STREAMS_COLS)
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
+    /* names are unique, so a lookup by name has at most one match */
+    if (col == 1 && (sv->indexed || streams_build_index(sv)))
+    {
+        const char *name;
+        char *encname;
+        uintptr_t found = 0;
+
+        if (index)
+            return NO_MORE_ITEMS;
+        *handle = (MSIITERHANDLE)(uintptr_t)1;
+
+        name = msi_string_lookup_id(sv->db->strings, val);
+        if (!name)
+            return NO_MORE_ITEMS;
+
+        encname = encode_streamname(false, name);
+        if (encname)
+            found = (uintptr_t)msi_name_index_find(&sv->index, encname);
+        msi_free(encname);
+        if (!found)
+            return NO_MORE_ITEMS;
+
+        *row = found - 1;
+        return LIBMSI_RESULT_SUCCESS;
+    }
+
     while (index < sv->num_rows)
     {
-        if (sv->streams[index]->str_index == val)
+        if (stream_str_index(sv, sv->streams[index]) == val)
         {
             *row = index;
             break;
@@ -360,6 +439,8 @@ static const LibmsiViewOps streams_ops =
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
 };
 
 static unsigned add_stream_to_table(const char *name, GsfInput *stm, void *opaque)
@@ -373,7 +454,7 @@ static unsigned add_stream_to_table(const char *name, GsfInput *stm, void *opaqu
 
     if (!streams_set_table_size(sv, ++sv->num_rows))
     {
-        msi_free(stream);
+        free_stream(stream);
         return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
     }
 
@@ -388,7 +469,7 @@ static unsigned add_streams_to_table(LibmsiStreamsView *sv)
     if (!sv->streams)
         return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
 
-    return msi_enum_db_streams(sv->db, add_stream_to_table, sv);
+    return msi_enum_db_streams(sv->db, false, add_stream_to_table, sv);
 }
 
 unsigned streams_view_create(LibmsiDatabase *db, LibmsiView **view)
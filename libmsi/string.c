@@ -36,17 +36,36 @@ struct msistring
 {
     uint16_t persistent_refcount;
     uint16_t nonpersistent_refcount;
+    unsigned hash : 31;
+    unsigned in_chunk : 1;     /* str was carved out of a string chunk */
     char *str;
 };
 
+/* strings loaded from the pool are carved out of a few large chunks,
+ * which are freed together with the table */
+struct string_chunk
+{
+    struct string_chunk *next;
+    size_t used;
+    size_t size;
+    char data[1];
+};
+
 struct string_table
 {
     unsigned maxcount;         /* the number of strings */
-    unsigned freeslot;
+    unsigned freecount;        /* the number of free ids */
     unsigned codepage;
-    unsigned sortcount;
+    unsigned hashcount;        /* the number of ids in the index */
+    unsigned dupcount;         /* the number of ids repeating an indexed string */
+    unsigned hashsize;         /* a power of two */
     struct msistring *strings; /* an array of strings */
-    unsigned *sorted;              /* index */
+    unsigned *hash;            /* index of ids by string, 0 is a free bucket */
+    unsigned *freeids;         /* stack of free ids, lowest on top */
+    unsigned conv_codepage;    /* the codepage of the converters */
+    GIConv import_conv;        /* from the codepage to UTF-8 */
+    GIConv export_conv;        /* from UTF-8 to the codepage */
+    struct string_chunk *chunks; /* the most recent chunk first */
 };
 
 static bool validate_codepage( unsigned codepage )
@@ -71,6 +90,153 @@ static bool validate_codepage( unsigned codepage )
     }
 }
 
+/* EBCDIC and UTF-7 are the only codepages that do not encode ASCII as is */
+static bool codepage_is_ascii( unsigned codepage )
+{
+    switch (codepage) {
+    case 37: case 424: case 500: case 875: case 1026: case 65000:
+        return false;
+
+    default:
+        return true;
+    }
+}
+
+static bool string_is_ascii( const char *str, size_t len )
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if ((uint8_t)str[i] >= 0x80)
+            return false;
+    return true;
+}
+
+static unsigned st_codepage( const string_table *st )
+{
+    return st->codepage ? st->codepage : gsf_msole_iconv_win_codepage();
+}
+
+static void st_close_converters( string_table *st )
+{
+    if (st->import_conv != (GIConv)-1)
+        g_iconv_close(st->import_conv);
+    if (st->export_conv != (GIConv)-1)
+        g_iconv_close(st->export_conv);
+    st->import_conv = (GIConv)-1;
+    st->export_conv = (GIConv)-1;
+}
+
+/* the converters are opened on first use and kept until the codepage
+ * changes */
+static void st_check_converters( string_table *st, unsigned codepage )
+{
+    if (st->conv_codepage != codepage)
+    {
+        st_close_converters( st );
+        st->conv_codepage = codepage;
+    }
+}
+
+static GIConv st_export_conv( string_table *st, unsigned codepage )
+{
+    st_check_converters( st, codepage );
+    if (st->export_conv == (GIConv)-1)
+        st->export_conv = gsf_msole_iconv_open_codepage_for_export(codepage);
+    return st->export_conv;
+}
+
+static bool add_string_chunk( struct string_chunk **chunks, size_t size )
+{
+    struct string_chunk *chunk;
+
+    chunk = msi_alloc( offsetof( struct string_chunk, data[size] ) );
+    if (!chunk)
+        return false;
+
+    chunk->next = *chunks;
+    chunk->used = 0;
+    chunk->size = size;
+    *chunks = chunk;
+    return true;
+}
+
+static char *string_chunk_alloc( struct string_chunk **chunks, size_t size )
+{
+    struct string_chunk *chunk = *chunks;
+    char *p;
+
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        if (!add_string_chunk( chunks, MAX( size, 0x10000 ) ))
+            return NULL;
+        chunk = *chunks;
+    }
+
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/* convert len bytes in the given codepage to a UTF-8 string allocated
+ * from chunks; the converter is opened when first needed */
+static char *decode_string( unsigned codepage, GIConv *conv, struct string_chunk **chunks,
+                            const char *data, int len, size_t *sz, GError **err )
+{
+    char *str, *utf8;
+
+    if (len < 0)
+        len = strlen(data);
+
+    if ((codepage == 65001 && g_utf8_validate(data, len, NULL)) ||
+        (codepage_is_ascii(codepage) && string_is_ascii(data, len)))
+    {
+        str = string_chunk_alloc( chunks, len + 1 );
+        if (!str)
+            return NULL;
+        memcpy( str, data, len );
+        str[len] = 0;
+        *sz = len;
+        return str;
+    }
+
+    if (*conv == (GIConv)-1)
+        *conv = gsf_msole_iconv_open_for_import(codepage);
+    utf8 = g_convert_with_iconv(data, len, *conv, NULL, sz, err);
+    if (!utf8)
+        return NULL;
+
+    str = string_chunk_alloc( chunks, *sz + 1 );
+    if (str)
+        memcpy( str, utf8, *sz + 1 );
+    msi_free( utf8 );
+    return str;
+}
+
+static char *st_import_string( string_table *st, const char *data, int len, size_t *sz, GError **err )
+{
+    unsigned codepage = st_codepage( st );
+
+    st_check_converters( st, codepage );
+    return decode_string( codepage, &st->import_conv, &st->chunks, data, len, sz, err );
+}
+
+/* convert a UTF-8 string to the table's codepage; the string itself is
+ * returned when it needs no conversion */
+static char *st_export_string( string_table *st, const char *str, size_t *len )
+{
+    unsigned codepage = st_codepage( st );
+    size_t n = strlen(str);
+
+    if (codepage == 65001 || (codepage_is_ascii(codepage) && string_is_ascii(str, n)))
+    {
+        *len = n;
+        return (char *)str;
+    }
+
+    return g_convert_with_iconv(str, n, st_export_conv( st, codepage ), NULL, len, NULL);
+}
+
 static string_table *init_stringtable( int entries, unsigned codepage )
 {
     string_table *st;
@@ -91,18 +257,36 @@ static string_table *init_stringtable( int entries, unsigned codepage )
         return NULL;    
     }
 
-    st->sorted = msi_alloc( sizeof (unsigned) * entries );
-    if( !st->sorted )
+    /* size the index so that loading the pool never grows it */
+    st->hashsize = 16;
+    while (st->hashsize / 4 * 3 <= entries)
+        st->hashsize *= 2;
+    st->hash = msi_alloc_zero( sizeof (unsigned) * st->hashsize );
+    if( !st->hash )
+    {
+        msi_free( st->strings );
+        msi_free( st );
+        return NULL;
+    }
+
+    st->freeids = msi_alloc( sizeof (unsigned) * entries );
+    if( !st->freeids )
     {
+        msi_free( st->hash );
         msi_free( st->strings );
         msi_free( st );
         return NULL;
     }
 
     st->maxcount = entries;
-    st->freeslot = 1;
+    st->freecount = 0;
     st->codepage = codepage;
-    st->sortcount = 0;
+    st->conv_codepage = codepage;
+    st->import_conv = (GIConv)-1;
+    st->export_conv = (GIConv)-1;
+    st->chunks = NULL;
+    st->hashcount = 0;
+    st->dupcount = 0;
 
     return st;
 }
@@ -113,92 +297,138 @@ void msi_destroy_stringtable( string_table *st )
 
     for( i=0; i<st->maxcount; i++ )
     {
-        if( st->strings[i].persistent_refcount ||
-            st->strings[i].nonpersistent_refcount )
+        if( (st->strings[i].persistent_refcount ||
+             st->strings[i].nonpersistent_refcount) &&
+            !st->strings[i].in_chunk )
             msi_free( st->strings[i].str );
     }
+    while( st->chunks )
+    {
+        struct string_chunk *chunk = st->chunks;
+
+        st->chunks = chunk->next;
+        msi_free( chunk );
+    }
     msi_free( st->strings );
-    msi_free( st->sorted );
+    st_close_converters( st );
+    msi_free( st->hash );
+    msi_free( st->freeids );
     msi_free( st );
 }
 
+static void st_release_entry( string_table *st, unsigned n )
+{
+    st->freeids[st->freecount++] = n;
+}
+
+/* collect the ids that loading left unused, so that they are handed out
+ * in ascending order */
+static void st_init_free_entries( string_table *st )
+{
+    unsigned i;
+
+    st->freecount = 0;
+    for( i = st->maxcount - 1; i > 0; i-- )
+        if( !st->strings[i].persistent_refcount &&
+            !st->strings[i].nonpersistent_refcount )
+            st_release_entry( st, i );
+}
+
 static int st_find_free_entry( string_table *st )
 {
-    unsigned i, sz, *s;
+    unsigned i, sz, *f;
     struct msistring *p;
 
     TRACE("%p\n", st);
 
-    if( st->freeslot )
-    {
-        for( i = st->freeslot; i < st->maxcount; i++ )
-            if( !st->strings[i].persistent_refcount &&
-                !st->strings[i].nonpersistent_refcount )
-                return i;
-    }
-    for( i = 1; i < st->maxcount; i++ )
-        if( !st->strings[i].persistent_refcount &&
-            !st->strings[i].nonpersistent_refcount )
-            return i;
+    if( st->freecount )
+        return st->freeids[--st->freecount];
 
     /* dynamically resize */
     sz = st->maxcount + 1 + st->maxcount/2;
     p = msi_realloc_zero( st->strings, st->maxcount * sizeof(struct msistring), sz * sizeof(struct msistring) );
     if( !p )
         return -1;
+    st->strings = p;
 
-    s = msi_realloc( st->sorted, sz*sizeof(unsigned) );
-    if( !s )
-    {
-        msi_free( p );
+    f = msi_realloc( st->freeids, sz * sizeof(unsigned) );
+    if( !f )
         return -1;
-    }
+    st->freeids = f;
 
-    st->strings = p;
-    st->sorted = s;
+    for( i = sz - 1; i > st->maxcount; i-- )
+        st_release_entry( st, i );
 
-    st->freeslot = st->maxcount;
+    i = st->maxcount;
     st->maxcount = sz;
-    if( st->strings[st->freeslot].persistent_refcount ||
-        st->strings[st->freeslot].nonpersistent_refcount )
-        g_critical("oops. expected freeslot to be free...\n");
-    return st->freeslot;
+    return i;
 }
 
-G_GNUC_PURE
-static int find_insert_index( const string_table *st, unsigned string_id )
+static bool resize_string_hash( string_table *st, unsigned size )
 {
-    int i, c, low = 0, high = st->sortcount - 1;
+    unsigned i, j, id, mask = size - 1;
+    unsigned *hash;
 
-    while (low <= high)
-    {
-        i = (low + high) / 2;
-        c = strcmp( st->strings[string_id].str, st->strings[st->sorted[i]].str );
+    hash = msi_alloc_zero( size * sizeof(unsigned) );
+    if( !hash )
+        return false;
 
-        if (c < 0)
-            high = i - 1;
-        else if (c > 0)
-            low = i + 1;
-        else
-            return -1; /* already exists */
+    for( i = 0; i < st->hashsize; i++ )
+    {
+        id = st->hash[i];
+        if( !id )
+            continue;
+        for( j = st->strings[id].hash & mask; hash[j]; j = (j + 1) & mask )
+            ;
+        hash[j] = id;
     }
-    return high + 1;
+
+    msi_free( st->hash );
+    st->hash = hash;
+    st->hashsize = size;
+    return true;
 }
 
-static void insert_string_sorted( string_table *st, unsigned string_id )
+/* the hash kept with a string, which leaves a bit of its entry free */
+static inline unsigned string_hash( const char *str )
 {
-    int i;
+    return g_str_hash( str ) & 0x7fffffff;
+}
 
-    i = find_insert_index( st, string_id );
-    if (i == -1)
+/* the first id added for a string is the one it is found under */
+static void insert_string_hash( string_table *st, unsigned string_id )
+{
+    struct msistring *entry = &st->strings[string_id];
+    unsigned j, mask;
+
+    if( (st->hashcount + 1) * 4 > st->hashsize * 3 &&
+        !resize_string_hash( st, st->hashsize * 2 ) &&
+        st->hashcount + 1 >= st->hashsize )
+    {
+        g_critical("no room to index string %u\n", string_id);
         return;
+    }
 
-    memmove( &st->sorted[i] + 1, &st->sorted[i], (st->sortcount - i) * sizeof(unsigned) );
-    st->sorted[i] = string_id;
-    st->sortcount++;
+    entry->hash = string_hash( entry->str );
+    mask = st->hashsize - 1;
+    for( j = entry->hash & mask; st->hash[j]; j = (j + 1) & mask )
+    {
+        const struct msistring *other = &st->strings[st->hash[j]];
+
+        if( other->hash == entry->hash && !strcmp( other->str, entry->str ) )
+        {
+            /* already exists */
+            st->dupcount++;
+            return;
+        }
+    }
+    st->hash[j] = string_id;
+    st->hashcount++;
 }
 
-static void set_st_entry( string_table *st, unsigned n, char *str, uint16_t refcount, enum StringPersistence persistence )
+/* in_chunk tells whether str belongs to a string chunk or is freed by itself */
+static void set_st_entry( string_table *st, unsigned n, char *str, bool in_chunk,
+                          uint16_t refcount, enum StringPersistence persistence )
 {
     g_return_if_fail(str != NULL);
 
@@ -214,20 +444,16 @@ static void set_st_entry( string_table *st, unsigned n, char *str, uint16_t refc
     }
 
     st->strings[n].str = str;
+    st->strings[n].in_chunk = in_chunk;
 
-    insert_string_sorted( st, n );
-
-    if( n < st->maxcount )
-        st->freeslot = n + 1;
+    insert_string_hash( st, n );
 }
 
-static unsigned _libmsi_id_from_string( const string_table *st, const char *buffer, unsigned *id )
+static unsigned _libmsi_id_from_string( string_table *st, const char *buffer, unsigned *id )
 {
     size_t sz;
     unsigned r = LIBMSI_RESULT_INVALID_PARAMETER;
     char *str;
-    int codepage;
-    GIConv cpconv;
 
     TRACE("Finding string %s in string table\n", debugstr_a(buffer) );
 
@@ -237,15 +463,13 @@ static unsigned _libmsi_id_from_string( const string_table *st, const char *buff
         return LIBMSI_RESULT_SUCCESS;
     }
 
-    codepage = st->codepage ? st->codepage : gsf_msole_iconv_win_codepage();
-    cpconv = gsf_msole_iconv_open_codepage_for_export(codepage);
-    str = g_convert_with_iconv(buffer, -1, cpconv, NULL, &sz, NULL);
-    g_iconv_close(cpconv);
+    str = st_export_string( st, buffer, &sz );
     if( !str )
         return r;
 
     r = _libmsi_id_from_string_utf8( st, str, id );
-    msi_free( str );
+    if( str != buffer )
+        msi_free( str );
     return r;
 }
 
@@ -253,9 +477,8 @@ static int msi_addstring( string_table *st, unsigned n, const char *data, int le
 {
     char *str;
     size_t sz;
-    int codepage;
-    GIConv cpconv;
     GError *err = NULL;
+    bool allocated = false;
 
     if( !data )
         return 0;
@@ -280,6 +503,7 @@ static int msi_addstring( string_table *st, unsigned n, const char *data, int le
         n = st_find_free_entry( st );
         if( n == -1 )
             return -1;
+        allocated = true;
     }
 
     if( n < 1 )
@@ -289,15 +513,14 @@ static int msi_addstring( string_table *st, unsigned n, const char *data, int le
     }
 
     /* allocate a new string */
-    codepage = st->codepage ? st->codepage : gsf_msole_iconv_win_codepage();
-    cpconv = gsf_msole_iconv_open_for_import(codepage);
-    str = g_convert_with_iconv(data, len, cpconv, NULL, &sz, &err);
-    g_iconv_close(cpconv);
+    str = st_import_string( st, data, len, &sz, &err );
     if (err) {
         g_warning("iconv failed: %s", err->message);
         g_clear_error(&err);
+        if( allocated )
+            st_release_entry( st, n );
     } else {
-        set_st_entry( st, n, str, refcount, persistence);
+        set_st_entry( st, n, str, true, refcount, persistence);
     }
 
     return n;
@@ -333,11 +556,14 @@ int _libmsi_add_string( string_table *st, const char *data, int len, uint16_t re
 
     str = msi_alloc( (len+1)*sizeof(char) );
     if( !str )
+    {
+        st_release_entry( st, n );
         return -1;
+    }
     memcpy( str, data, len*sizeof(char) );
     str[len] = 0;
 
-    set_st_entry( st, n, str, refcount, persistence );
+    set_st_entry( st, n, str, false, refcount, persistence );
 
     return n;
 }
@@ -358,44 +584,25 @@ const char *msi_string_lookup_id( const string_table *st, unsigned id )
     return st->strings[id].str;
 }
 
-/*
- *  _libmsi_string_id
- *
- *  [in] st         - pointer to the string table
- *  [in] id         - id of the string to retrieve
- *  [out] buffer    - destination of the UTF8 string
- *  [in/out] sz     - number of bytes available in the buffer on input
- *                    number of bytes used on output
- *
- * Returned string is not NUL-terminated.
- */
-static unsigned _libmsi_string_id( const string_table *st, unsigned id, char *buffer, unsigned *sz )
+/* whether a stored pool repeats a string under several ids */
+bool msi_string_has_duplicates( const string_table *st )
 {
-    const char *str_utf8;
-    char *str;
-    size_t len;
-    GIConv cpconv;
-    int codepage;
+    return st->dupcount != 0;
+}
 
-    TRACE("Finding string %d of %d\n", id, st->maxcount);
+/* the id a string is found under, which differs from id when a stored
+ * pool repeats the string under several ids */
+unsigned msi_string_first_id( const string_table *st, unsigned id )
+{
+    const char *str;
 
-    str_utf8 = msi_string_lookup_id( st, id );
-    if( !str_utf8 )
-        return LIBMSI_RESULT_FUNCTION_FAILED;
+    if( !st->dupcount )
+        return id;
 
-    codepage = st->codepage ? st->codepage : gsf_msole_iconv_win_codepage();
-    cpconv = gsf_msole_iconv_open_codepage_for_export(codepage);
-    str = g_convert_with_iconv(str_utf8, -1, cpconv, NULL, &len, NULL);
-    g_iconv_close(cpconv);
-    if( *sz < len )
-    {
-        *sz = len;
-        return LIBMSI_RESULT_MORE_DATA;
-    }
-    *sz = len;
-    memcpy(buffer, str, len);
-    msi_free(str);
-    return LIBMSI_RESULT_SUCCESS;
+    str = msi_string_lookup_id( st, id );
+    if( str && *str )
+        _libmsi_id_from_string_utf8( st, str, &id );
+    return id;
 }
 
 /*
@@ -407,20 +614,16 @@ static unsigned _libmsi_string_id( const string_table *st, unsigned id, char *bu
  */
 unsigned _libmsi_id_from_string_utf8( const string_table *st, const char *str, unsigned *id )
 {
-    int i, c, low = 0, high = st->sortcount - 1;
+    unsigned hash = string_hash( str );
+    unsigned j, mask = st->hashsize - 1;
 
-    while (low <= high)
+    for( j = hash & mask; st->hash[j]; j = (j + 1) & mask )
     {
-        i = (low + high) / 2;
-        c = strcmp( str, st->strings[st->sorted[i]].str );
+        const struct msistring *entry = &st->strings[st->hash[j]];
 
-        if (c < 0)
-            high = i - 1;
-        else if (c > 0)
-            low = i + 1;
-        else
+        if( entry->hash == hash && !strcmp( str, entry->str ) )
         {
-            *id = st->sorted[i];
+            *id = st->hash[j];
             return LIBMSI_RESULT_SUCCESS;
         }
     }
@@ -428,46 +631,38 @@ unsigned _libmsi_id_from_string_utf8( const string_table *st, const char *str, u
     return LIBMSI_RESULT_INVALID_PARAMETER;
 }
 
-static void string_totalsize( const string_table *st, unsigned *datasize, unsigned *poolsize )
+/* a string in the form it is saved in */
+/* refs, if not NULL, holds the number of references to each string when
+ * the pool is being compacted */
+static unsigned saved_refcount( const string_table *st, const unsigned *refs, unsigned n )
 {
-    unsigned i, holesize;
-    size_t len;
-    int codepage;
-    GIConv cpconv;
-    char *str;
+    return refs ? refs[n] : st->strings[n].persistent_refcount;
+}
 
-    if( st->strings[0].str || st->strings[0].persistent_refcount || st->strings[0].nonpersistent_refcount)
-        g_critical("oops. element 0 has a string\n");
+/* StringPool entries are buffered and written a chunk at a time */
+struct pool_writer
+{
+    GsfOutput *stm;
+    unsigned used;
+    bool ok;
+    uint8_t *buf;
+};
 
-    codepage = st->codepage ? st->codepage : gsf_msole_iconv_win_codepage();
+static void pool_flush( struct pool_writer *w )
+{
+    if( w->used && !gsf_output_write( w->stm, w->used, w->buf ) )
+        w->ok = false;
+    w->used = 0;
+}
 
-    *poolsize = 4;
-    *datasize = 0;
-    holesize = 0;
-    for( i=1; i<st->maxcount; i++ )
-    {
-        if( !st->strings[i].persistent_refcount )
-        {
-            TRACE("[%u] nonpersistent = %s\n", i, debugstr_a(st->strings[i].str));
-            (*poolsize) += 4;
-        }
-        else if( st->strings[i].str )
-        {
-            TRACE("[%u] = %s\n", i, debugstr_a(st->strings[i].str));
-            cpconv = gsf_msole_iconv_open_codepage_for_export(codepage);
-            str = g_convert_with_iconv( st->strings[i].str, -1, cpconv, NULL, &len, NULL);
-            g_iconv_close(cpconv);
-	    msi_free(str);
-            (*datasize) += len;
-            if (len>0xffff)
-                (*poolsize) += 4;
-            (*poolsize) += holesize + 4;
-            holesize = 0;
-        }
-        else
-            holesize += 4;
-    }
-    TRACE("data %u pool %u codepage %x\n", *datasize, *poolsize, st->codepage );
+static void pool_write_entry( struct pool_writer *w, unsigned lo, unsigned hi )
+{
+    if( w->used == MSI_WRITE_CHUNK_SIZE )
+        pool_flush( w );
+    w->buf[w->used++] = lo;
+    w->buf[w->used++] = lo >> 8;
+    w->buf[w->used++] = hi;
+    w->buf[w->used++] = hi >> 8;
 }
 
 string_table *msi_init_string_table( unsigned *bytes_per_strref )
@@ -480,20 +675,165 @@ string_table *msi_init_string_table( unsigned *bytes_per_strref )
     return st;
 }
 
-string_table *msi_load_string_table( GsfInfile *stg, unsigned *bytes_per_strref )
+/* where a string of the pool is found in _StringData */
+struct pool_entry
 {
-    string_table *st = NULL;
-    char *data = NULL;
-    uint16_t *pool = NULL;
-    unsigned r, datasize = 0, poolsize = 0, codepage;
-    unsigned i, count, offset, len, n, refs;
+    unsigned n;
+    unsigned offset;
+    unsigned len;
+    uint16_t refs;
+    char *str;
+};
 
-    r = read_stream_data( stg, szStringPool, (uint8_t **)&pool, &poolsize );
-    if( r != LIBMSI_RESULT_SUCCESS)
-        goto end;
-    r = read_stream_data( stg, szStringData, (uint8_t **)&data, &datasize );
-    if( r != LIBMSI_RESULT_SUCCESS)
-        goto end;
+/* a run of pool entries decoded on a worker thread */
+struct pool_decode_job
+{
+    const char *data;
+    struct pool_entry *entries;
+    unsigned count;
+    unsigned codepage;
+    struct string_chunk *chunks;
+};
+
+/* LIBMSI_DECODE_THREADS sets the number of threads used to decode the
+ * string pool, 0 meaning one per processor */
+static unsigned pool_decode_threads( void )
+{
+    const char *env = g_getenv( "LIBMSI_DECODE_THREADS" );
+    int n;
+
+    if (!env)
+        return 1;
+    n = atoi( env );
+    if (n <= 0)
+        n = g_get_num_processors();
+    return n;
+}
+
+static void decode_pool_job( gpointer data, gpointer user_data )
+{
+    struct pool_decode_job *job = data;
+    GIConv conv = (GIConv)-1;
+    GError *err = NULL;
+    unsigned i, bytes = 0;
+    size_t sz;
+
+    for (i = 0; i < job->count; i++)
+        bytes += job->entries[i].len + 1;
+    add_string_chunk( &job->chunks, bytes );
+
+    for (i = 0; i < job->count; i++)
+    {
+        struct pool_entry *entry = &job->entries[i];
+        const char *str = job->data + entry->offset;
+
+        if (!str[0])
+            continue;
+
+        entry->str = decode_string( job->codepage, &conv, &job->chunks, str, entry->len, &sz, &err );
+        if (err)
+        {
+            g_warning("iconv failed: %s", err->message);
+            g_clear_error(&err);
+        }
+    }
+
+    if (conv != (GIConv)-1)
+        g_iconv_close(conv);
+}
+
+/* convert the strings on a thread pool and add them to the table in the
+ * same order as they would be added one by one */
+static bool decode_pool_parallel( string_table *st, const char *data,
+                                  struct pool_entry *entries, unsigned count,
+                                  unsigned threads )
+{
+    struct pool_decode_job *jobs;
+    struct string_chunk *chunk;
+    unsigned i, njobs, per_job;
+    GThreadPool *pool;
+
+    njobs = threads * 4;
+    per_job = (count + njobs - 1) / njobs;
+    njobs = (count + per_job - 1) / per_job;
+
+    jobs = msi_alloc_zero( njobs * sizeof(*jobs) );
+    if (!jobs)
+        return false;
+    pool = g_thread_pool_new( decode_pool_job, NULL, threads, TRUE, NULL );
+    if (!pool)
+    {
+        msi_free( jobs );
+        return false;
+    }
+
+    for (i = 0; i < njobs; i++)
+    {
+        jobs[i].data = data;
+        jobs[i].entries = &entries[i * per_job];
+        jobs[i].count = MIN( per_job, count - i * per_job );
+        jobs[i].codepage = st_codepage( st );
+        g_thread_pool_push( pool, &jobs[i], NULL );
+    }
+    g_thread_pool_free( pool, FALSE, TRUE );
+
+    for (i = 0; i < njobs; i++)
+    {
+        while ((chunk = jobs[i].chunks))
+        {
+            jobs[i].chunks = chunk->next;
+            chunk->next = st->chunks;
+            st->chunks = chunk;
+        }
+    }
+    msi_free( jobs );
+
+    for (i = 0; i < count; i++)
+    {
+        if (!data[entries[i].offset])
+            g_critical("Failed to add string %d\n", entries[i].n );
+        else if (entries[i].str)
+            set_st_entry( st, entries[i].n, entries[i].str, true, entries[i].refs, StringPersistent );
+    }
+    return true;
+}
+
+/*
+ * When mapped is true the pool is decoded in place from the storage's
+ * buffers, which is only safe if they cannot be reused by the second
+ * read, i.e. when the file is memory mapped.
+ */
+string_table *msi_load_string_table( GsfInfile *stg, bool mapped, unsigned *bytes_per_strref )
+{
+    string_table *st = NULL;
+    const char *data = NULL;
+    const uint16_t *pool = NULL;
+    uint8_t *pool_copy = NULL, *data_copy = NULL;
+    GsfInput *pool_stm = NULL, *data_stm = NULL;
+    struct pool_entry *entries = NULL;
+    unsigned r, datasize = 0, poolsize = 0, codepage, threads;
+    unsigned i, count, offset, len, n, refs, nentries;
+
+    if( mapped )
+    {
+        r = map_stream_data( stg, szStringPool, (const uint8_t **)&pool, &poolsize, &pool_stm );
+        if( r != LIBMSI_RESULT_SUCCESS)
+            goto end;
+        r = map_stream_data( stg, szStringData, (const uint8_t **)&data, &datasize, &data_stm );
+        if( r != LIBMSI_RESULT_SUCCESS)
+            goto end;
+    }
+    else
+    {
+        r = read_stream_data( stg, szStringPool, &pool_copy, &poolsize );
+        if( r != LIBMSI_RESULT_SUCCESS)
+            goto end;
+        r = read_stream_data( stg, szStringData, &data_copy, &datasize );
+        if( r != LIBMSI_RESULT_SUCCESS)
+            goto end;
+        pool = (const uint16_t *)pool_copy;
+        data = (const char *)data_copy;
+    }
 
     if ( (poolsize > 4) && (GUINT_FROM_LE(pool[1]) & 0x8000) )
         *bytes_per_strref = LONG_STR_BYTES;
@@ -510,7 +850,18 @@ string_table *msi_load_string_table( GsfInfile *stg, unsigned *bytes_per_strref
     if (!st)
         goto end;
 
+    entries = msi_alloc( count * sizeof(*entries) );
+    if (!entries)
+    {
+        msi_destroy_stringtable( st );
+        st = NULL;
+        goto end;
+    }
+
+    /* find where each string starts, which only depends on the lengths
+     * of the strings before it */
     offset = 0;
+    nentries = 0;
     n = 1;
     i = 1;
     while ( i<count )
@@ -548,9 +899,12 @@ string_table *msi_load_string_table( GsfInfile *stg, unsigned *bytes_per_strref
             break;
         }
 
-        r = msi_addstring( st, n, data+offset, len, refs, StringPersistent );
-        if( r != n )
-            g_critical("Failed to add string %d\n", n );
+        entries[nentries].n = n;
+        entries[nentries].offset = offset;
+        entries[nentries].len = len;
+        entries[nentries].refs = refs;
+        entries[nentries].str = NULL;
+        nentries++;
         n++;
         offset += len;
     }
@@ -558,83 +912,160 @@ string_table *msi_load_string_table( GsfInfile *stg, unsigned *bytes_per_strref
     if ( datasize != offset )
         g_critical("string table load failed! (%08x != %08x), please report\n", datasize, offset );
 
+    threads = pool_decode_threads();
+    if (threads < 2 || nentries < 0x1000 ||
+        !decode_pool_parallel( st, data, entries, nentries, threads ))
+    {
+        /* room for every string and its terminator, unless they grow
+         * when converted to UTF-8 */
+        add_string_chunk( &st->chunks, datasize + count );
+
+        for (i = 0; i < nentries; i++)
+        {
+            r = msi_addstring( st, entries[i].n, data + entries[i].offset, entries[i].len,
+                               entries[i].refs, StringPersistent );
+            if( r != entries[i].n )
+                g_critical("Failed to add string %d\n", entries[i].n );
+        }
+    }
+
+    st_init_free_entries( st );
+
     TRACE("Loaded %d strings\n", count);
 
 end:
-    msi_free( pool );
-    msi_free( data );
+    msi_free( entries );
+    msi_free( pool_copy );
+    msi_free( data_copy );
+    if( pool_stm )
+        g_object_unref(G_OBJECT(pool_stm));
+    if( data_stm )
+        g_object_unref(G_OBJECT(data_stm));
 
     return st;
 }
 
-unsigned msi_save_string_table( const string_table *st, LibmsiDatabase *db, unsigned *bytes_per_strref )
+/*
+ * When refs is not NULL, only the strings it counts references to are
+ * saved, with consecutive ids, and map receives the new id of each string.
+ *
+ * StringData is written one string at a time and StringPool a chunk at a
+ * time, so that only the length of each string needs to be kept around.
+ */
+unsigned msi_save_string_table( string_table *st, LibmsiDatabase *db, const unsigned *refs,
+                                unsigned *map, unsigned *bytes_per_strref )
 {
-    unsigned i, datasize = 0, poolsize = 0, sz, used, r, codepage, n;
+    unsigned n, count, holes, sz, refcount;
     unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
-    char *data = NULL;
-    uint8_t *pool = NULL;
+    struct pool_writer pool = { NULL, 0, true, NULL };
+    GsfOutput *stm = NULL;
+    unsigned *lens;
+    size_t len;
+    char *data;
 
     TRACE("\n");
 
-    /* construct the new table in memory first */
-    string_totalsize( st, &datasize, &poolsize );
-
-    TRACE("%u %u %u\n", st->maxcount, datasize, poolsize );
+    if( st->strings[0].str || st->strings[0].persistent_refcount || st->strings[0].nonpersistent_refcount)
+        g_critical("oops. element 0 has a string\n");
 
-    pool = msi_alloc( poolsize );
-    if( ! pool )
+    lens = msi_alloc_zero( st->maxcount * sizeof(*lens) );
+    pool.buf = msi_alloc( MSI_WRITE_CHUNK_SIZE );
+    if( !lens || !pool.buf )
     {
-        g_warning("Failed to alloc pool %d bytes\n", poolsize );
+        ret = LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
         goto err;
     }
-    data = msi_alloc( datasize );
-    if( ! data )
+
+    count = 1;
+    if( map )
+        map[0] = 0;
+    for( n=1; n<st->maxcount; n++ )
     {
-        g_warning("Failed to alloc data %d bytes\n", datasize );
-        goto err;
+        if( refs && !refs[n] )
+        {
+            map[n] = 0;
+            continue;
+        }
+        if( map )
+            map[n] = count;
+        count++;
     }
 
-    used = 0;
-    codepage = st->codepage;
-    pool[0] = codepage & 0xff;
-    pool[1] = codepage >> 8;
-    pool[2] = codepage >> 16;
-    pool[3] = codepage >> 24;
-    if (st->maxcount > 0xffff)
-    {
-        pool[3] |= 0x80;
+    if (count > 0xffff)
         *bytes_per_strref = LONG_STR_BYTES;
-    }
     else
         *bytes_per_strref = sizeof(uint16_t);
 
-    i = 1;
+    TRACE("%u strings, codepage %x\n", count, st->codepage );
+
+    /* the string data, converting each string as it is written */
+    stm = create_stream_output( db, szStringData );
+    if( !stm )
+        goto err;
     for( n=1; n<st->maxcount; n++ )
     {
-        if( !st->strings[n].persistent_refcount )
+        if( !saved_refcount( st, refs, n ) || !st->strings[n].str )
+            continue;
+
+        TRACE("[%u] = %s\n", n, debugstr_a(st->strings[n].str));
+        data = st_export_string( st, st->strings[n].str, &len );
+        if( !data )
         {
-            pool[ i*4 ] = 0;
-            pool[ i*4 + 1] = 0;
-            pool[ i*4 + 2] = 0;
-            pool[ i*4 + 3] = 0;
-            i++;
+            g_critical("failed to fetch string\n");
             continue;
         }
+        lens[n] = len;
+        if( len && !gsf_output_write( stm, len, data ) )
+            pool.ok = false;
+        if( data != st->strings[n].str )
+            msi_free( data );
+        if( !pool.ok )
+        {
+            g_warning("Failed to Write\n");
+            goto err;
+        }
+    }
+    gsf_output_close( stm );
+    g_object_unref( G_OBJECT(stm) );
+    TRACE("Wrote StringData\n");
 
-        sz = datasize - used;
-        r = _libmsi_string_id( st, n, data+used, &sz );
-        if( r != LIBMSI_RESULT_SUCCESS )
+    /* then the pool, which describes the data */
+    stm = pool.stm = create_stream_output( db, szStringPool );
+    if( !stm )
+        goto err;
+
+    pool_write_entry( &pool, st->codepage, (st->codepage >> 16) | (count > 0xffff ? 0x8000 : 0) );
+
+    holes = 0;
+    for( n=1; n<st->maxcount; n++ )
+    {
+        if( refs && !refs[n] )
+            continue;
+
+        refcount = saved_refcount( st, refs, n );
+        if( !refcount )
         {
-            g_critical("failed to fetch string\n");
-            sz = 0;
+            TRACE("[%u] nonpersistent = %s\n", n, debugstr_a(st->strings[n].str));
+            pool_write_entry( &pool, 0, 0 );
+            continue;
         }
 
-        if (sz == 0) {
-            pool[ i*4 ] = 0;
-            pool[ i*4 + 1 ] = 0;
-            pool[ i*4 + 2 ] = 0;
-            pool[ i*4 + 3 ] = 0;
-            i++;
+        /* ids without a string are only written if a string follows them,
+         * so the pool no longer ends in empty entries for referenced ids
+         * that lost their string; the ids loading gives the strings are
+         * the same */
+        if( !st->strings[n].str )
+        {
+            holes++;
+            continue;
+        }
+        for( ; holes; holes-- )
+            pool_write_entry( &pool, 0, 0 );
+
+        sz = lens[n];
+        if (sz == 0)
+        {
+            pool_write_entry( &pool, 0, 0 );
             continue;
         }
 
@@ -642,50 +1073,38 @@ unsigned msi_save_string_table( const string_table *st, LibmsiDatabase *db, unsi
         {
             /* Write a dummy entry, with the high part of the length
              * in the reference count.  */
-            pool[ i*4 ] = 0;
-            pool[ i*4 + 1 ] = 0;
-            pool[ i*4 + 2 ] = (sz >> 16);
-            pool[ i*4 + 3 ] = (sz >> 24);
-            i++;
-        }
-        pool[ i*4 ]     = sz;
-        pool[ i*4 + 1 ] = sz >> 8;
-        pool[ i*4 + 2 ] = st->strings[n].persistent_refcount;
-        pool[ i*4 + 3 ] = st->strings[n].persistent_refcount >> 8;
-        i++;
-        used += sz;
-        if( used > datasize  )
-        {
-            g_critical("oops overran %d >= %d\n", used, datasize);
-            goto err;
+            pool_write_entry( &pool, 0, sz >> 16 );
         }
+        pool_write_entry( &pool, sz, refcount );
     }
-
-    if( used != datasize )
+    pool_flush( &pool );
+    TRACE("Wrote StringPool ok=%d\n", pool.ok);
+    if( !pool.ok )
     {
-        g_critical("oops used %d != datasize %d\n", used, datasize);
+        g_warning("Failed to Write\n");
         goto err;
     }
 
-    /* write the streams */
-    r = write_stream_data( db, szStringData, data, datasize );
-    TRACE("Wrote StringData r=%08x\n", r);
-    if( r )
-        goto err;
-    r = write_stream_data( db, szStringPool, pool, poolsize );
-    TRACE("Wrote StringPool r=%08x\n", r);
-    if( r )
-        goto err;
-
     ret = LIBMSI_RESULT_SUCCESS;
 
 err:
-    msi_free( data );
-    msi_free( pool );
+    if( stm )
+    {
+        gsf_output_close( stm );
+        g_object_unref( G_OBJECT(stm) );
+    }
+    msi_free( pool.buf );
+    msi_free( lens );
 
     return ret;
 }
 
+G_GNUC_PURE
+unsigned msi_get_string_table_count( const string_table *st )
+{
+    return st->maxcount;
+}
+
 G_GNUC_PURE
 unsigned msi_get_string_table_codepage( const string_table *st )
 {
@@ -20,6 +20,9 @@
 
 #include <stdarg.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "libmsi.h"
 #include "msipriv.h"
@@ -28,17 +31,27 @@
 #include "debug.h"
 
 
-#define LibmsiTable_HASH_TABLE_SIZE 37
+#define LibmsiTable_HASH_MIN_SIZE 16
+#define LibmsiTable_HASH_EMPTY    (~0u)
 
 static const char szDot[] = ".";
 
 typedef struct _LibmsiColumnHashEntry
 {
-    struct _LibmsiColumnHashEntry *next;
     unsigned value;
-    unsigned row;
+    unsigned slot;
 } LibmsiColumnHashEntry;
 
+/* open addressing index of the values of a column, using linear probing.
+ * The number of entries is a power of two and at most half of them are used,
+ * so a probe sequence always ends on an empty entry. */
+typedef struct _LibmsiColumnHash
+{
+    unsigned mask;
+    unsigned count;
+    LibmsiColumnHashEntry entries[1];
+} LibmsiColumnHash;
+
 typedef struct _LibmsiColumnInfo
 {
     const char *tablename;
@@ -48,22 +61,96 @@ typedef struct _LibmsiColumnInfo
     unsigned    offset;
     int     ref_count;
     bool    temporary;
-    LibmsiColumnHashEntry **hash_table;
+    LibmsiColumnHash *hash_table;
 } LibmsiColumnInfo;
 
+/* the values of one column, 16 bits wide for columns of up to two bytes
+ * and 32 bits wide otherwise */
+typedef struct _LibmsiColumnData
+{
+    bool wide;
+    void *values;
+} LibmsiColumnData;
+
+#define MAX_STREAM_NAME 0x1f
+
+/* room for any encoded table stream name, see encode_streamname_buf */
+#define TABLE_STREAM_NAME_SIZE (MAX_STREAM_NAME * 3)
+
+/* tables are stored by column, each column in an array of row_alloc slots.
+ * The arrays are gap buffers: rows before gap_start are in the slots of
+ * the same number, the unused slots follow and the remaining rows fill the
+ * end of the arrays.  Inserting or deleting a row only moves the rows
+ * between the gap and that row, so changes made in key order are cheap.
+ * The column indexes record slots, which only change for the rows the gap
+ * moves across.  data_persistent has one bit per slot.  dirty is set when
+ * the table no longer matches its stream in the infile.  stream_names
+ * caches, per slot, the name of the stream of the row's binary data
+ * followed by its encoded form. */
 struct _LibmsiTable
 {
-    uint8_t **data;
-    bool *data_persistent;
+    LibmsiColumnData *data;
+    uint32_t *data_persistent;
     unsigned row_count;
+    unsigned row_alloc;
+    unsigned gap_start;
     struct list entry;
     LibmsiColumnInfo *colinfo;
     unsigned col_count;
     LibmsiCondition persistent;
     int ref_count;
+    LibmsiColumnHash *key_index;
+    bool dirty;
+    char **stream_names;
+    char encname[TABLE_STREAM_NAME_SIZE];
     char name[1];
 };
 
+static inline unsigned table_slot( const LibmsiTable *t, unsigned row )
+{
+    return row < t->gap_start ? row : row + t->row_alloc - t->row_count;
+}
+
+static inline unsigned table_slot_row( const LibmsiTable *t, unsigned slot )
+{
+    return slot < t->gap_start ? slot : slot - (t->row_alloc - t->row_count);
+}
+
+static inline unsigned read_slot_int( const LibmsiTable *t, unsigned slot, unsigned col )
+{
+    const LibmsiColumnData *c = &t->data[col];
+
+    return c->wide ? ((const uint32_t *)c->values)[slot] : ((const uint16_t *)c->values)[slot];
+}
+
+static inline void write_slot_int( LibmsiTable *t, unsigned slot, unsigned col, unsigned val )
+{
+    LibmsiColumnData *c = &t->data[col];
+
+    if (c->wide)
+        ((uint32_t *)c->values)[slot] = val;
+    else
+        ((uint16_t *)c->values)[slot] = val;
+}
+
+static inline unsigned read_table_int( const LibmsiTable *t, unsigned row, unsigned col )
+{
+    return read_slot_int( t, table_slot( t, row ), col );
+}
+
+static inline bool table_slot_persistent( const LibmsiTable *t, unsigned slot )
+{
+    return (t->data_persistent[slot / 32] >> (slot % 32)) & 1;
+}
+
+static inline void table_set_slot_persistent( LibmsiTable *t, unsigned slot, bool persistent )
+{
+    if (persistent)
+        t->data_persistent[slot / 32] |= 1u << (slot % 32);
+    else
+        t->data_persistent[slot / 32] &= ~(1u << (slot % 32));
+}
+
 /* information for default tables */
 static const char szTables[]  = "_Tables";
 static const char szTable[]   = "Table";
@@ -82,8 +169,6 @@ static const LibmsiColumnInfo _Tables_cols[1] = {
     { szTables,  1, szName,   MSITYPE_VALID | MSITYPE_STRING | MSITYPE_KEY | 64, 0, 0, 0, NULL },
 };
 
-#define MAX_STREAM_NAME 0x1f
-
 static inline unsigned bytes_per_column( LibmsiDatabase *db, const LibmsiColumnInfo *col, unsigned bytes_per_strref )
 {
     if( MSITYPE_IS_BINARY(col->type) )
@@ -101,32 +186,41 @@ static inline unsigned bytes_per_column( LibmsiDatabase *db, const LibmsiColumnI
     return 4;
 }
 
-static int utf2mime(int x)
+/* the base64-like digit of each ASCII character allowed in stream names */
+static const int8_t utf2mime[0x80] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, -1, -1, -1, -1, 63,
+    -1, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50,
+    51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1,
+};
+
+static const char mime_digits[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz._";
+
+static inline char mime2utf( unsigned x )
 {
-    if( (x>='0') && (x<='9') )
-        return x-'0';
-    if( (x>='A') && (x<='Z') )
-        return x-'A'+10;
-    if( (x>='a') && (x<='z') )
-        return x-'a'+10+26;
-    if( x=='.' )
-        return 10+26+26;
-    if( x=='_' )
-        return 10+26+26+1;
-    return -1;
+    return x < 64 ? mime_digits[x] : '_';
 }
 
-char *encode_streamname(bool bTable, const char *in)
+/* Encode a stream name into out, which needs room for three bytes per
+ * character plus two.  For table names (MAX_STREAM_NAME - 1 characters
+ * at most) TABLE_STREAM_NAME_SIZE bytes are always enough. */
+bool encode_streamname_buf( bool bTable, const char *name, char *out, size_t size )
 {
+    const uint8_t *in = (const uint8_t *)name;
     unsigned count = MAX_STREAM_NAME;
-    unsigned ch, next;
-    char *out;
-    char *p;
+    uint8_t *p = (uint8_t *)out;
+    int ch, next;
 
     if( !bTable )
-        count = strlen( in )+2;
-    if (!(out = msi_alloc( count*3 ))) return NULL;
-    p = out;
+        count = strlen( name )+2;
+    if( size < count*3 )
+        return false;
 
     if( bTable )
     {
@@ -142,17 +236,12 @@ char *encode_streamname(bool bTable, const char *in)
         if( !ch )
         {
             *p = ch;
-            return out;
+            return true;
         }
-        if( ( ch < 0x80 ) && ( utf2mime(ch) >= 0 ) )
+        if( ( ch < 0x80 ) && ( utf2mime[ch] >= 0 ) )
         {
-            ch = utf2mime(ch);
-            next = *in;
-            if( next && (next<0x80) ) {
-                next = utf2mime(next);
-            } else {
-                next = -1;
-            }
+            ch = utf2mime[ch];
+            next = *in < 0x80 ? utf2mime[*in] : -1;
             if( next == -1 )
             {
                 /* UTF-8 encoding of 0x4800..0x483f.  */
@@ -170,34 +259,34 @@ char *encode_streamname(bool bTable, const char *in)
             *p++ = ch;
         }
     }
-    g_critical("Failed to encode stream name (%s)\n",debugstr_a(in));
-    msi_free( out );
-    return NULL;
+    g_critical("Failed to encode stream name (%s)\n",debugstr_a(name));
+    return false;
 }
 
-static int mime2utf(int x)
+char *encode_streamname(bool bTable, const char *in)
 {
-    if( x<10 )
-        return x + '0';
-    if( x<(10+26))
-        return x - 10 + 'A';
-    if( x<(10+26+26))
-        return x - 10 - 26 + 'a';
-    if( x == (10+26+26) )
-        return '.';
-    return '_';
+    size_t size = (bTable ? MAX_STREAM_NAME : strlen( in )+2) * 3;
+    char *out;
+
+    if (!(out = msi_alloc( size ))) return NULL;
+    if (!encode_streamname_buf( bTable, in, out, size ))
+    {
+        msi_free( out );
+        return NULL;
+    }
+    return out;
 }
 
-char *decode_streamname(const char *in)
+/* Decode a stream name into out, which needs room for as many bytes as
+ * the encoded name. */
+bool decode_streamname_buf(const char *in, char *out, size_t size)
 {
-    unsigned count = 0;
     const uint8_t *p = (const uint8_t *)in;
-    char *out;
-    uint8_t *q;
+    uint8_t *q = (uint8_t *)out;
+
+    if( size < strlen(in) + 1 )
+        return false;
 
-    g_return_val_if_fail(in != NULL, NULL);
-    out = g_malloc0(strlen(in) + 1);
-    q = (uint8_t *)out;
     while ( *p )
     {
         uint8_t ch = *p;
@@ -207,14 +296,12 @@ char *decode_streamname(const char *in)
             *q++ = mime2utf(p[2]&0x7f);
             *q++ = mime2utf(p[1]^0xa0);
             p += 3;
-            count += 2;
             continue;
         }
         if( ch == 0xe4 && p[1] == 0xa0 ) {
             /* UTF-8 encoding of 0x4800..0x483f.  */
             *q++ = mime2utf(p[2]&0x7f);
             p += 3;
-            count++;
             continue;
         }
         *q++ = *p++;
@@ -227,9 +314,20 @@ char *decode_streamname(const char *in)
         if( ch >= 0xf0) {
             *q++ = *p++;
         }
-        count++;
     }
     *q = 0;
+    return true;
+}
+
+char *decode_streamname(const char *in)
+{
+    size_t size;
+    char *out;
+
+    g_return_val_if_fail(in != NULL, NULL);
+    size = strlen(in) + 1;
+    out = g_malloc0(size);
+    decode_streamname_buf(in, out, size);
     return out;
 }
 
@@ -252,37 +350,48 @@ void enum_stream_names( GsfInfile *stg )
     }
 }
 
-unsigned read_stream_data( GsfInfile *stg, const char *stname,
-                       uint8_t **pdata, unsigned *psz )
+/* the stream functions take plain table stream names, and have variants
+ * for the names already encoded by encode_streamname_buf */
+static unsigned open_stream_data( GsfInfile *stg, const char *encname,
+                                  GsfInput **pstm, unsigned *psz )
 {
-    unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
-    void *data;
-    unsigned sz;
-    GsfInput *stm = NULL;
-    char *encname;
-
-    encname = encode_streamname(true, stname);
+    GsfInput *stm;
 
-    TRACE("%s -> %s\n",debugstr_a(stname),debugstr_a(encname));
-
-    if ( !stg )
+    if ( !stg || !encname[0] )
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
     stm = gsf_infile_child_by_name(stg, encname );
-    msi_free(encname);
     if( !stm )
     {
         TRACE("open stream failed - empty table?\n");
-        return ret;
+        return LIBMSI_RESULT_FUNCTION_FAILED;
     }
 
     if( gsf_input_size(stm) >> 32 )
     {
         g_warning("Too big!\n");
-        goto end;
+        g_object_unref(G_OBJECT(stm));
+        return LIBMSI_RESULT_FUNCTION_FAILED;
     }
-        
-    sz = gsf_input_size(stm);
+
+    *pstm = stm;
+    *psz = gsf_input_size(stm);
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static unsigned read_encoded_stream_data( GsfInfile *stg, const char *encname,
+                                          uint8_t **pdata, unsigned *psz )
+{
+    unsigned ret;
+    void *data;
+    unsigned sz;
+    GsfInput *stm = NULL;
+
+    ret = open_stream_data( stg, encname, &stm, &sz );
+    if ( ret != LIBMSI_RESULT_SUCCESS )
+        return ret;
+
+    ret = LIBMSI_RESULT_FUNCTION_FAILED;
     if ( !sz )
     {
         data = NULL;
@@ -315,25 +424,95 @@ end:
     return ret;
 }
 
-unsigned write_stream_data( LibmsiDatabase *db, const char *stname,
-                        const void *data, unsigned sz )
+unsigned read_stream_data( GsfInfile *stg, const char *stname,
+                       uint8_t **pdata, unsigned *psz )
 {
-    unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
-    char *encname;
-    GsfOutput *stm;
+    char encname[TABLE_STREAM_NAME_SIZE];
+
+    if ( !encode_streamname_buf( true, stname, encname, sizeof(encname) ) )
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    TRACE("%s -> %s\n",debugstr_a(stname),debugstr_a(encname));
+    return read_encoded_stream_data( stg, encname, pdata, psz );
+}
 
-    if (!db->outfile)
+/* Like read_stream_data, but returns a pointer to the stream contents
+ * owned by libgsf instead of a copy.  When the file is memory mapped
+ * and the stream's blocks are contiguous this points straight into the
+ * mapping.  The data stays valid until *pstm is released.
+ */
+static unsigned map_encoded_stream_data( GsfInfile *stg, const char *encname,
+                                         const uint8_t **pdata, unsigned *psz, GsfInput **pstm )
+{
+    const uint8_t *data = NULL;
+    unsigned ret, sz;
+    GsfInput *stm = NULL;
+
+    ret = open_stream_data( stg, encname, &stm, &sz );
+    if ( ret != LIBMSI_RESULT_SUCCESS )
         return ret;
 
-    encname = encode_streamname(true, stname );
+    if ( sz )
+    {
+        data = gsf_input_read( stm, sz, NULL );
+        if ( !data )
+        {
+            g_warning("read stream failed\n");
+            g_object_unref(G_OBJECT(stm));
+            return LIBMSI_RESULT_FUNCTION_FAILED;
+        }
+    }
+
+    *pdata = data;
+    *psz = sz;
+    *pstm = stm;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+unsigned map_stream_data( GsfInfile *stg, const char *stname,
+                          const uint8_t **pdata, unsigned *psz, GsfInput **pstm )
+{
+    char encname[TABLE_STREAM_NAME_SIZE];
+
+    if ( !encode_streamname_buf( true, stname, encname, sizeof(encname) ) )
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    TRACE("%s -> %s\n",debugstr_a(stname),debugstr_a(encname));
+    return map_encoded_stream_data( stg, encname, pdata, psz, pstm );
+}
+
+static GsfOutput *create_encoded_stream_output( LibmsiDatabase *db, const char *encname )
+{
+    GsfOutput *stm;
+
+    if (!db->outfile || !encname[0])
+        return NULL;
 
     stm = gsf_outfile_new_child( db->outfile, encname, false );
-    msi_free( encname );
     if( !stm )
-    {
         g_warning("open stream failed\n");
+    return stm;
+}
+
+GsfOutput *create_stream_output( LibmsiDatabase *db, const char *stname )
+{
+    char encname[TABLE_STREAM_NAME_SIZE];
+
+    if (!encode_streamname_buf( true, stname, encname, sizeof(encname) ))
+        return NULL;
+
+    return create_encoded_stream_output( db, encname );
+}
+
+unsigned write_stream_data( LibmsiDatabase *db, const char *stname,
+                        const void *data, unsigned sz )
+{
+    unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
+    GsfOutput *stm;
+
+    stm = create_stream_output( db, stname );
+    if( !stm )
         return ret;
-    }
 
     if (! gsf_output_write(stm, sz, data) )
     {
@@ -349,21 +528,268 @@ end:
     return ret;
 }
 
+/* Copy a whole stream in large blocks.  gsf_input_copy goes 4k at a time,
+ * which for an OLE stream means a seek and a short read of the file per
+ * block.  Reading without a buffer also lets libgsf return its own data,
+ * which is the file itself for contiguous sectors of a mapped file.
+ */
+bool copy_stream_data( GsfInput *in, GsfOutput *out )
+{
+    const guint8 *data;
+    gsf_off_t remaining;
+    size_t n;
+
+    if ( gsf_input_seek( in, 0, G_SEEK_SET ) )
+        return false;
+
+    remaining = gsf_input_size( in );
+    while ( remaining > 0 )
+    {
+        n = MIN( remaining, MSI_COPY_BLOCK_SIZE );
+        data = gsf_input_read( in, n, NULL );
+        if ( !data || !gsf_output_write( out, n, data ) )
+        {
+            g_warning("stream copy failed\n");
+            return false;
+        }
+        remaining -= n;
+    }
+    return true;
+}
+
 static void msi_free_colinfo( LibmsiColumnInfo *colinfo, unsigned count )
 {
     unsigned i;
     for (i = 0; i < count; i++) msi_free( colinfo[i].hash_table );
 }
 
-static void free_table( LibmsiTable *table )
+static inline unsigned column_hash_bucket( unsigned value )
+{
+    value ^= value >> 16;
+    value *= 0x45d9f3b;
+    value ^= value >> 16;
+    return value;
+}
+
+static LibmsiColumnHash *column_hash_alloc( unsigned rows )
+{
+    LibmsiColumnHash *hash;
+    unsigned size = LibmsiTable_HASH_MIN_SIZE;
+
+    while (size < rows * 2)
+    {
+        if (size > G_MAXUINT / 4)
+            return NULL;
+        size *= 2;
+    }
+
+    hash = msi_alloc( offsetof( LibmsiColumnHash, entries[size] ) );
+    if (!hash)
+        return NULL;
+
+    hash->mask = size - 1;
+    hash->count = 0;
+    memset( hash->entries, 0xff, size * sizeof(LibmsiColumnHashEntry) );
+    return hash;
+}
+
+/* the caller guarantees there is a free entry */
+static void column_hash_add( LibmsiColumnHash *hash, unsigned value, unsigned slot )
+{
+    unsigned i = column_hash_bucket( value ) & hash->mask;
+
+    while (hash->entries[i].slot != LibmsiTable_HASH_EMPTY)
+        i = (i + 1) & hash->mask;
+
+    hash->entries[i].value = value;
+    hash->entries[i].slot = slot;
+    hash->count++;
+}
+
+static void column_hash_insert( LibmsiColumnHash **phash, unsigned value, unsigned slot )
+{
+    LibmsiColumnHash *hash = *phash;
+
+    if ((hash->count + 1) * 2 > hash->mask + 1)
+    {
+        LibmsiColumnHash *new_hash;
+        unsigned i;
+
+        new_hash = column_hash_alloc( (hash->mask + 1) );
+        if (!new_hash)
+        {
+            /* drop the index, it is rebuilt on the next lookup */
+            msi_free( hash );
+            *phash = NULL;
+            return;
+        }
+
+        for (i = 0; i <= hash->mask; i++)
+        {
+            if (hash->entries[i].slot != LibmsiTable_HASH_EMPTY)
+                column_hash_add( new_hash, hash->entries[i].value, hash->entries[i].slot );
+        }
+        msi_free( hash );
+        *phash = hash = new_hash;
+    }
+
+    column_hash_add( hash, value, slot );
+}
+
+static void column_hash_remove( LibmsiColumnHash *hash, unsigned value, unsigned slot )
+{
+    unsigned i, j, k;
+
+    i = column_hash_bucket( value ) & hash->mask;
+    while (hash->entries[i].value != value || hash->entries[i].slot != slot)
+    {
+        if (hash->entries[i].slot == LibmsiTable_HASH_EMPTY)
+            return;
+        i = (i + 1) & hash->mask;
+    }
+
+    /* move back any following entry whose probe sequence went through i */
+    for (j = i;;)
+    {
+        j = (j + 1) & hash->mask;
+        if (hash->entries[j].slot == LibmsiTable_HASH_EMPTY)
+            break;
+
+        k = column_hash_bucket( hash->entries[j].value ) & hash->mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        hash->entries[i] = hash->entries[j];
+        i = j;
+    }
+
+    hash->entries[i].value = LibmsiTable_HASH_EMPTY;
+    hash->entries[i].slot = LibmsiTable_HASH_EMPTY;
+    hash->count--;
+}
+
+/* record that the row with the given value moved to another slot */
+static void column_hash_relocate( LibmsiColumnHash *hash, unsigned value, unsigned from, unsigned to )
 {
     unsigned i;
-    for( i=0; i<table->row_count; i++ )
-        msi_free( table->data[i] );
-    msi_free( table->data );
+
+    for (i = column_hash_bucket( value ) & hash->mask;
+         hash->entries[i].slot != LibmsiTable_HASH_EMPTY;
+         i = (i + 1) & hash->mask)
+    {
+        if (hash->entries[i].value == value && hash->entries[i].slot == from)
+        {
+            hash->entries[i].slot = to;
+            return;
+        }
+    }
+}
+
+static inline bool column_is_wide( const LibmsiColumnInfo *col )
+{
+    return !MSITYPE_IS_BINARY(col->type) &&
+           ((col->type & MSITYPE_STRING) || (col->type & 0xff) > 2);
+}
+
+static bool column_is_string( const LibmsiColumnInfo *col )
+{
+    return (col->type & MSITYPE_STRING) && !MSITYPE_IS_BINARY(col->type);
+}
+
+static void free_table_data( LibmsiColumnData *data, unsigned count )
+{
+    unsigned i;
+
+    if (!data)
+        return;
+    for (i = 0; i < count; i++)
+        msi_free( data[i].values );
+    msi_free( data );
+}
+
+/* set up the empty columns of a table from its column info */
+static unsigned table_alloc_data( LibmsiTable *t )
+{
+    unsigned i;
+
+    t->data = NULL;
+    if (!t->col_count)
+        return LIBMSI_RESULT_SUCCESS;
+
+    t->data = msi_alloc_zero( t->col_count * sizeof(LibmsiColumnData) );
+    if (!t->data)
+        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+
+    for (i = 0; i < t->col_count; i++)
+        t->data[i].wide = column_is_wide( &t->colinfo[i] );
+
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+/* grow the column arrays to alloc slots; the gap must be at the end */
+static unsigned table_resize_data( LibmsiTable *t, unsigned alloc )
+{
+    uint32_t *b;
+    void *p;
+    unsigned i;
+
+    for (i = 0; i < t->col_count; i++)
+    {
+        p = msi_realloc( t->data[i].values, (size_t)alloc * (t->data[i].wide ? 4 : 2) );
+        if (!p)
+            return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+        t->data[i].values = p;
+    }
+
+    b = msi_realloc( t->data_persistent, (alloc + 31) / 32 * sizeof(uint32_t) );
+    if (!b)
+        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+    t->data_persistent = b;
+
+    if (t->stream_names)
+    {
+        char **names = msi_realloc( t->stream_names, (size_t)alloc * sizeof(char *) );
+        if (!names)
+            return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+        memset( names + t->row_alloc, 0, (size_t)(alloc - t->row_alloc) * sizeof(char *) );
+        t->stream_names = names;
+    }
+
+    t->row_alloc = alloc;
+    t->gap_start = t->row_count;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static void free_stream_names( LibmsiTable *t )
+{
+    unsigned i;
+
+    if (!t->stream_names)
+        return;
+    for (i = 0; i < t->row_alloc; i++)
+        msi_free( t->stream_names[i] );
+    msi_free( t->stream_names );
+    t->stream_names = NULL;
+}
+
+/* forget the cached stream name of a slot whose key changed or went away */
+static inline void forget_stream_name( LibmsiTable *t, unsigned slot )
+{
+    if (t->stream_names && t->stream_names[slot])
+    {
+        msi_free( t->stream_names[slot] );
+        t->stream_names[slot] = NULL;
+    }
+}
+
+static void free_table( LibmsiTable *table )
+{
+    free_stream_names( table );
+    free_table_data( table->data, table->col_count );
     msi_free( table->data_persistent );
     msi_free_colinfo( table->colinfo, table->col_count );
     msi_free( table->colinfo );
+    msi_free( table->key_index );
     msi_free( table );
 }
 
@@ -384,21 +810,171 @@ static unsigned msi_table_get_row_size( LibmsiDatabase *db, const LibmsiColumnIn
     return last_col->offset + bytes_per_column( db, last_col, bytes_per_strref );
 }
 
+/* decode a column of n byte values from a table stream */
+static void read_table_column( LibmsiColumnData *c, const uint8_t *src, unsigned count, unsigned n )
+{
+    unsigned i = 0;
+
+    if (c->wide)
+    {
+        uint32_t *dst = c->values;
+
+        switch (n)
+        {
+        case 2:
+#ifdef __SSE2__
+            for (; i + 8 <= count; i += 8)
+            {
+                __m128i x = _mm_loadu_si128( (const __m128i *)&src[i * 2] );
+                _mm_storeu_si128( (__m128i *)&dst[i], _mm_unpacklo_epi16( x, _mm_setzero_si128() ) );
+                _mm_storeu_si128( (__m128i *)&dst[i + 4], _mm_unpackhi_epi16( x, _mm_setzero_si128() ) );
+            }
+#endif
+            for (; i < count; i++)
+                dst[i] = src[i * 2] | src[i * 2 + 1] << 8;
+            break;
+        case 3:
+            for (; i < count; i++)
+                dst[i] = src[i * 3] | src[i * 3 + 1] << 8 | src[i * 3 + 2] << 16;
+            break;
+        case 4:
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+            memcpy( dst, src, count * 4 );
+#else
+            for (; i < count; i++)
+                dst[i] = src[i * 4] | src[i * 4 + 1] << 8 | src[i * 4 + 2] << 16 | (uint32_t)src[i * 4 + 3] << 24;
+#endif
+            break;
+        }
+    }
+    else
+    {
+        uint16_t *dst = c->values;
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        memcpy( dst, src, count * 2 );
+#else
+        for (; i < count; i++)
+            dst[i] = src[i * 2] | src[i * 2 + 1] << 8;
+#endif
+    }
+}
+
+/* encode count values of a column, starting at the given slot, as n byte
+ * values of a table stream */
+static void write_table_column( uint8_t *dst, const LibmsiColumnData *c, unsigned slot,
+                                unsigned count, unsigned n )
+{
+    unsigned i = 0;
+
+    if (c->wide)
+    {
+        const uint32_t *src = (const uint32_t *)c->values + slot;
+
+        switch (n)
+        {
+        case 2:
+#ifdef __SSE2__
+            for (; i + 8 <= count; i += 8)
+            {
+                /* sign extend the low halves so that the saturating pack keeps them */
+                __m128i lo = _mm_loadu_si128( (const __m128i *)&src[i] );
+                __m128i hi = _mm_loadu_si128( (const __m128i *)&src[i + 4] );
+                lo = _mm_srai_epi32( _mm_slli_epi32( lo, 16 ), 16 );
+                hi = _mm_srai_epi32( _mm_slli_epi32( hi, 16 ), 16 );
+                _mm_storeu_si128( (__m128i *)&dst[i * 2], _mm_packs_epi32( lo, hi ) );
+            }
+#endif
+            for (; i < count; i++)
+            {
+                dst[i * 2] = src[i];
+                dst[i * 2 + 1] = src[i] >> 8;
+            }
+            break;
+        case 3:
+            for (; i < count; i++)
+            {
+                dst[i * 3] = src[i];
+                dst[i * 3 + 1] = src[i] >> 8;
+                dst[i * 3 + 2] = src[i] >> 16;
+            }
+            break;
+        case 4:
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+            memcpy( dst, src, count * 4 );
+#else
+            for (; i < count; i++)
+            {
+                dst[i * 4] = src[i];
+                dst[i * 4 + 1] = src[i] >> 8;
+                dst[i * 4 + 2] = src[i] >> 16;
+                dst[i * 4 + 3] = src[i] >> 24;
+            }
+#endif
+            break;
+        }
+    }
+    else
+    {
+        const uint16_t *src = (const uint16_t *)c->values + slot;
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        memcpy( dst, src, count * 2 );
+#else
+        for (; i < count; i++)
+        {
+            dst[i * 2] = src[i];
+            dst[i * 2 + 1] = src[i] >> 8;
+        }
+#endif
+    }
+}
+
+/* give the string columns of a table just read from the file the ids of
+ * their strings in memory, which differ after a compacting commit */
+static void map_file_string_ids( LibmsiDatabase *db, LibmsiTable *t )
+{
+    uint32_t *values;
+    unsigned i, j;
+
+    if (!db->string_ids)
+        return;
+
+    for (j = 0; j < t->col_count; j++)
+    {
+        if (!column_is_string( &t->colinfo[j] ))
+            continue;
+        values = t->data[j].values;
+        for (i = 0; i < t->row_count; i++)
+            values[i] = values[i] < db->string_id_count ? db->string_ids[values[i]] : 0;
+    }
+}
+
 /* add this table to the list of cached tables in the database */
 static unsigned read_table_from_storage( LibmsiDatabase *db, LibmsiTable *t, GsfInfile *stg )
 {
-    uint8_t *rawdata = NULL;
-    unsigned rawsize = 0, i, j, row_size, row_size_mem;
+    const uint8_t *rawdata = NULL;
+    uint8_t *copy = NULL;
+    GsfInput *stm = NULL;
+    unsigned rawsize = 0, j, ofs, row_size, r = LIBMSI_RESULT_FUNCTION_FAILED;
 
     TRACE("%s\n",debugstr_a(t->name));
 
+    if( table_alloc_data( t ) != LIBMSI_RESULT_SUCCESS )
+        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+
     row_size = msi_table_get_row_size( db, t->colinfo, t->col_count, db->bytes_per_strref );
-    row_size_mem = msi_table_get_row_size( db, t->colinfo, t->col_count, LONG_STR_BYTES );
 
     /* if we can't read the table, just assume that it's empty */
-    read_stream_data( stg, t->name, &rawdata, &rawsize );
+    if( db->mapped )
+        map_encoded_stream_data( stg, t->encname, &rawdata, &rawsize, &stm );
+    else
+    {
+        read_encoded_stream_data( stg, t->encname, &copy, &rawsize );
+        rawdata = copy;
+    }
     if( !rawdata )
-        return LIBMSI_RESULT_SUCCESS;
+        goto end;
 
     TRACE("Read %d bytes\n", rawsize );
 
@@ -409,60 +985,35 @@ static unsigned read_table_from_storage( LibmsiDatabase *db, LibmsiTable *t, Gsf
     }
 
     t->row_count = rawsize / row_size;
-    t->data = msi_alloc_zero( t->row_count * sizeof (uint16_t*) );
-    if( !t->data )
-        goto err;
-    t->data_persistent = msi_alloc_zero( t->row_count * sizeof(bool));
-    if ( !t->data_persistent )
+    if( !t->row_count )
+        goto end;
+    if( table_resize_data( t, t->row_count ) != LIBMSI_RESULT_SUCCESS )
         goto err;
+    memset( t->data_persistent, 0xff, (t->row_count + 31) / 32 * sizeof(uint32_t) );
 
-    /* transpose all the data */
+    /* the stream is stored by column, like the table */
     TRACE("Transposing data from %d rows\n", t->row_count );
-    for (i = 0; i < t->row_count; i++)
+    for (j = 0, ofs = 0; j < t->col_count; j++)
     {
-        unsigned ofs = 0, ofs_mem = 0;
-
-        t->data[i] = msi_alloc( row_size_mem );
-        if( !t->data[i] )
-            goto err;
-        t->data_persistent[i] = true;
+        unsigned n = bytes_per_column( db, &t->colinfo[j], db->bytes_per_strref );
 
-        for (j = 0; j < t->col_count; j++)
+        if ( n != 2 && n != 3 && n != 4 )
         {
-            unsigned m = bytes_per_column( db, &t->colinfo[j], LONG_STR_BYTES );
-            unsigned n = bytes_per_column( db, &t->colinfo[j], db->bytes_per_strref );
-            unsigned k;
-
-            if ( n != 2 && n != 3 && n != 4 )
-            {
-                g_critical("oops - unknown column width %d\n", n);
-                goto err;
-            }
-            if (t->colinfo[j].type & MSITYPE_STRING && n < m)
-            {
-                for (k = 0; k < m; k++)
-                {
-                    if (k < n)
-                        t->data[i][ofs_mem + k] = rawdata[ofs * t->row_count + i * n + k];
-                    else
-                        t->data[i][ofs_mem + k] = 0;
-                }
-            }
-            else
-            {
-                for (k = 0; k < n; k++)
-                    t->data[i][ofs_mem + k] = rawdata[ofs * t->row_count + i * n + k];
-            }
-            ofs_mem += m;
-            ofs += n;
+            g_critical("oops - unknown column width %d\n", n);
+            goto err;
         }
+        read_table_column( &t->data[j], &rawdata[ofs * t->row_count], t->row_count, n );
+        ofs += n;
     }
+    map_file_string_ids( db, t );
 
-    msi_free( rawdata );
-    return LIBMSI_RESULT_SUCCESS;
+end:
+    r = LIBMSI_RESULT_SUCCESS;
 err:
-    msi_free( rawdata );
-    return LIBMSI_RESULT_FUNCTION_FAILED;
+    msi_free( copy );
+    if( stm )
+        g_object_unref(G_OBJECT(stm));
+    return r;
 }
 
 void free_cached_tables( LibmsiDatabase *db )
@@ -587,6 +1138,8 @@ unsigned _libmsi_open_table( LibmsiDatabase *db, const char *name, bool encoded
 
     table->persistent = LIBMSI_CONDITION_TRUE;
     strcpy( table->name, name );
+    if (!encode_streamname_buf( true, name, table->encname, sizeof(table->encname) ))
+        table->encname[0] = 0;
 
     if (!strcmp( name, szTables ) || !strcmp( name, szColumns ))
         table->persistent = LIBMSI_CONDITION_NONE;
@@ -636,16 +1189,6 @@ static unsigned get_table( LibmsiDatabase *db, const char *name, LibmsiTable **t
     return LIBMSI_RESULT_SUCCESS;
 }
 
-static unsigned read_table_int( uint8_t *const *data, unsigned row, unsigned col, unsigned bytes )
-{
-    unsigned ret = 0, i;
-
-    for (i = 0; i < bytes; i++)
-        ret += data[row][col + i] << i * 8;
-
-    return ret;
-}
-
 static unsigned get_tablecolumns( LibmsiDatabase *db, const char *szTableName, LibmsiColumnInfo *colinfo, unsigned *sz )
 {
     unsigned r, i, n = 0, table_id, count, maxcount = *sz;
@@ -681,11 +1224,11 @@ static unsigned get_tablecolumns( LibmsiDatabase *db, const char *szTableName, L
     count = table->row_count;
     for (i = 0; i < count; i++)
     {
-        if (read_table_int( table->data, i, 0, LONG_STR_BYTES) != table_id) continue;
+        if (read_table_int( table, i, 0 ) != table_id) continue;
         if (colinfo)
         {
-            unsigned id = read_table_int( table->data, i, table->colinfo[2].offset, LONG_STR_BYTES );
-            unsigned col = read_table_int( table->data, i, table->colinfo[1].offset, sizeof(uint16_t) ) - (1 << 15);
+            unsigned id = read_table_int( table, i, 2 );
+            unsigned col = read_table_int( table, i, 1 ) - (1 << 15);
 
             /* check the column number is in range */
             if (col < 1 || col > maxcount)
@@ -702,8 +1245,7 @@ static unsigned get_tablecolumns( LibmsiDatabase *db, const char *szTableName, L
             colinfo[col - 1].tablename = msi_string_lookup_id( db->strings, table_id );
             colinfo[col - 1].number = col;
             colinfo[col - 1].colname = msi_string_lookup_id( db->strings, id );
-            colinfo[col - 1].type = read_table_int( table->data, i, table->colinfo[3].offset,
-                                                    sizeof(uint16_t) ) - (1 << 15);
+            colinfo[col - 1].type = read_table_int( table, i, 3 ) - (1 << 15);
             colinfo[col - 1].offset = 0;
             colinfo[col - 1].ref_count = 0;
             colinfo[col - 1].hash_table = NULL;
@@ -747,12 +1289,19 @@ unsigned msi_create_table( LibmsiDatabase *db, const char *name, column_info *co
 
     table->ref_count = 1;
     table->row_count = 0;
+    table->row_alloc = 0;
+    table->gap_start = 0;
     table->data = NULL;
     table->data_persistent = NULL;
     table->colinfo = NULL;
     table->col_count = 0;
     table->persistent = persistent;
+    table->key_index = NULL;
+    table->dirty = true;
+    table->stream_names = NULL;
     strcpy( table->name, name );
+    if (!encode_streamname_buf( true, name, table->encname, sizeof(table->encname) ))
+        table->encname[0] = 0;
 
     for( col = col_info; col; col = col->next )
         table->col_count++;
@@ -779,6 +1328,11 @@ unsigned msi_create_table( LibmsiDatabase *db, const char *name, column_info *co
         table->colinfo[ i ].temporary = col->temporary;
     }
     table_calc_column_offsets( db, table->colinfo, table->col_count);
+    if (table_alloc_data( table ) != LIBMSI_RESULT_SUCCESS)
+    {
+        free_table( table );
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+    }
 
     r = table_view_create( db, szTables, &tv );
     TRACE("CreateView returned %x\n", r);
@@ -868,10 +1422,38 @@ err:
     return r;
 }
 
-static unsigned save_table( LibmsiDatabase *db, const LibmsiTable *t, unsigned bytes_per_strref )
+/* rows are written up to the first non-persistent one */
+static unsigned table_saved_rows( const LibmsiTable *t )
 {
-    uint8_t *rawdata = NULL;
-    unsigned rawsize, i, j, row_size, row_count;
+    unsigned count;
+
+    for (count = 0; count < t->row_count; count++)
+        if (!table_slot_persistent( t, table_slot( t, count ) )) break;
+    return count;
+}
+
+/* encode count rows of a column, starting at the given row, as n byte
+ * values of a table stream */
+static void write_table_rows( uint8_t *dst, const LibmsiTable *t, unsigned col,
+                              unsigned row, unsigned count, unsigned n )
+{
+    unsigned before = row < t->gap_start ? MIN( count, t->gap_start - row ) : 0;
+
+    write_table_column( dst, &t->data[col], row, before, n );
+    write_table_column( dst + before * n, &t->data[col], table_slot( t, row + before ),
+                        count - before, n );
+}
+
+/* map, if not NULL, gives the id each string is saved under.  The stream
+ * is written a column piece at a time, so no buffer for the whole table
+ * is needed. */
+static unsigned save_table( LibmsiDatabase *db, const LibmsiTable *t, unsigned bytes_per_strref,
+                            const unsigned *map )
+{
+    uint8_t *buf = NULL;
+    uint32_t *ids = NULL;
+    GsfOutput *stm = NULL;
+    unsigned i, j, k, id, count, chunk, len, map_count = 0;
     unsigned r = LIBMSI_RESULT_FUNCTION_FAILED;
 
     /* Nothing to do for non-persistent tables */
@@ -887,145 +1469,334 @@ static unsigned save_table( LibmsiDatabase *db, const LibmsiTable *t, unsigned b
 
     TRACE("Saving %s\n", debugstr_a( t->name ) );
 
-    row_size = msi_table_get_row_size( db, t->colinfo, t->col_count, bytes_per_strref );
-    row_count = t->row_count;
-    for (i = 0; i < t->row_count; i++)
+    /* Earlier versions sized the stream of a table holding non-persistent
+     * rows as if it had a single row, and laid the saved rows out with
+     * that stride.  The saved rows are now written as a table of count
+     * rows, which is how the stream is read back. */
+    count = table_saved_rows( t );
+
+    for (j = 0; j < t->col_count; j++)
     {
-        if (!t->data_persistent[i])
+        unsigned m = bytes_per_column( db, &t->colinfo[j], LONG_STR_BYTES );
+        unsigned n = bytes_per_column( db, &t->colinfo[j], bytes_per_strref );
+
+        if (n != 2 && n != 3 && n != 4)
         {
-            row_count = 1; /* yes, this is bizarre */
-            break;
+            g_critical("oops - unknown column width %d\n", n);
+            return LIBMSI_RESULT_FUNCTION_FAILED;
+        }
+        if (!map && t->colinfo[j].type & MSITYPE_STRING && n < m)
+        {
+            for (i = 0; i < count; i++)
+            {
+                id = read_table_int( t, i, j );
+                if (id > 1 << bytes_per_strref * 8)
+                {
+                    g_critical("string id %u out of range\n", id);
+                    return LIBMSI_RESULT_FUNCTION_FAILED;
+                }
+            }
         }
     }
-    rawsize = row_count * row_size;
-    rawdata = msi_alloc_zero( rawsize );
-    if( !rawdata )
+
+    /* columns are at most 4 bytes wide */
+    chunk = MSI_WRITE_CHUNK_SIZE / 4;
+    buf = msi_alloc( MSI_WRITE_CHUNK_SIZE );
+    if (map)
+    {
+        ids = msi_alloc( chunk * sizeof(uint32_t) );
+        map_count = msi_get_string_table_count( db->strings );
+    }
+    if (!buf || (map && !ids))
     {
         r = LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
         goto err;
     }
 
-    rawsize = 0;
-    for (i = 0; i < t->row_count; i++)
-    {
-        unsigned ofs = 0, ofs_mem = 0;
+    stm = create_encoded_stream_output( db, t->encname );
+    if (!stm)
+        goto err;
 
-        if (!t->data_persistent[i]) break;
+    TRACE("writing %d bytes\n", count * msi_table_get_row_size( db, t->colinfo, t->col_count, bytes_per_strref ));
 
-        for (j = 0; j < t->col_count; j++)
-        {
-            unsigned m = bytes_per_column( db, &t->colinfo[j], LONG_STR_BYTES );
-            unsigned n = bytes_per_column( db, &t->colinfo[j], bytes_per_strref );
-            unsigned k;
+    /* the stream is stored by column, like the table */
+    for (j = 0; j < t->col_count; j++)
+    {
+        unsigned n = bytes_per_column( db, &t->colinfo[j], bytes_per_strref );
 
-            if (n != 2 && n != 3 && n != 4)
-            {
-                g_critical("oops - unknown column width %d\n", n);
-                goto err;
-            }
-            if (t->colinfo[j].type & MSITYPE_STRING && n < m)
+        for (i = 0; i < count; i += len)
+        {
+            len = MIN( count - i, chunk );
+            if (map && column_is_string( &t->colinfo[j] ))
             {
-                unsigned id = read_table_int( t->data, i, ofs_mem, LONG_STR_BYTES );
-                if (id > 1 << bytes_per_strref * 8)
+                LibmsiColumnData mapped = { true, ids };
+
+                for (k = 0; k < len; k++)
                 {
-                    g_critical("string id %u out of range\n", id);
-                    goto err;
+                    id = read_table_int( t, i + k, j );
+                    if (id >= map_count)
+                    {
+                        g_critical("string id %u out of range\n", id);
+                        goto err;
+                    }
+                    ids[k] = map[id];
                 }
+                write_table_column( buf, &mapped, 0, len, n );
             }
-            for (k = 0; k < n; k++)
+            else
+                write_table_rows( buf, t, j, i, len, n );
+
+            if (!gsf_output_write( stm, len * n, buf ))
             {
-                rawdata[ofs * row_count + i * n + k] = t->data[i][ofs_mem + k];
+                g_warning("Failed to Write\n");
+                goto err;
             }
-            ofs_mem += m;
-            ofs += n;
         }
-        rawsize += row_size;
     }
-
-    TRACE("writing %d bytes\n", rawsize);
-    r = write_stream_data( db, t->name, rawdata, rawsize );
+    r = LIBMSI_RESULT_SUCCESS;
 
 err:
-    msi_free( rawdata );
+    if (stm)
+    {
+        gsf_output_close( stm );
+        g_object_unref( G_OBJECT(stm) );
+    }
+    msi_free( ids );
+    msi_free( buf );
     return r;
 }
 
-static void msi_update_table_columns( LibmsiDatabase *db, const char *name )
+static void msi_update_table_columns( LibmsiDatabase *db, const char *name )
+{
+    LibmsiTable *table;
+    LibmsiColumnData *old_data;
+    unsigned old_count;
+    unsigned n;
+
+    table = find_cached_table( db, name );
+    table->dirty = true;
+    old_count = table->col_count;
+    old_data = table->data;
+    msi_free_colinfo( table->colinfo, table->col_count );
+    msi_free( table->colinfo );
+    table->colinfo = NULL;
+    table->data = NULL;
+    msi_free( table->key_index );
+    table->key_index = NULL;
+
+    table_get_column_info( db, name, &table->colinfo, &table->col_count );
+    if (table_alloc_data( table ) != LIBMSI_RESULT_SUCCESS)
+        table->col_count = 0;
+
+    /* keep the values of the columns that are still there, and start the
+     * new columns out as zero */
+    for ( n = 0; n < table->col_count; n++ )
+    {
+        LibmsiColumnData *c = &table->data[n];
+        size_t size = (size_t)table->row_alloc * (c->wide ? 4 : 2);
+
+        if (n < old_count && old_data[n].wide == c->wide)
+        {
+            c->values = old_data[n].values;
+            old_data[n].values = NULL;
+        }
+        else if (size)
+        {
+            c->values = msi_alloc_zero( size );
+            if (!c->values)
+                g_critical("failed to allocate column %u of %s\n", n, debugstr_a(name));
+        }
+    }
+    free_table_data( old_data, old_count );
+}
+
+/* try to find the table name in the _Tables table */
+bool table_view_exists( LibmsiDatabase *db, const char *name )
+{
+    unsigned r, table_id, i;
+    LibmsiTable *table;
+
+    if( !strcmp( name, szTables ) || !strcmp( name, szColumns ) ||
+        !strcmp( name, szStreams ) || !strcmp( name, szStorages ) )
+        return true;
+
+    r = _libmsi_id_from_string_utf8( db->strings, name, &table_id );
+    if( r != LIBMSI_RESULT_SUCCESS )
+    {
+        TRACE("Couldn't find id for %s\n", debugstr_a(name));
+        return false;
+    }
+
+    r = get_table( db, szTables, &table );
+    if( r != LIBMSI_RESULT_SUCCESS )
+    {
+        g_critical("table %s not available\n", debugstr_a(szTables));
+        return false;
+    }
+
+    for( i = 0; i < table->row_count; i++ )
+    {
+        if( read_table_int( table, i, 0 ) == table_id )
+            return true;
+    }
+
+    return false;
+}
+
+/* below is the query interface to a table */
+
+typedef struct _LibmsiTableView
+{
+    LibmsiView        view;
+    LibmsiDatabase   *db;
+    LibmsiTable      *table;
+    LibmsiColumnInfo *columns;
+    unsigned           num_cols;
+    unsigned           row_size;
+    char          name[1];
+} LibmsiTableView;
+
+/* the primary key index of a table is keyed by a hash of the key columns of
+ * each row.  With a single key column the hash is the value itself, so the
+ * index can also serve lookups on that column. */
+static inline unsigned table_key_combine( unsigned hash, unsigned value, unsigned n )
+{
+    return n ? (hash * 0x01000193) ^ value : value;
+}
+
+static unsigned table_key_count( const LibmsiTableView *tv )
+{
+    unsigned i, n = 0;
+
+    for (i = 0; i < tv->num_cols; i++)
+        if (tv->columns[i].type & MSITYPE_KEY) n++;
+    return n;
+}
+
+static unsigned table_slot_key( const LibmsiTableView *tv, unsigned slot )
+{
+    unsigned i, n = 0, hash = 0;
+
+    for (i = 0; i < tv->num_cols; i++)
+    {
+        if (!(tv->columns[i].type & MSITYPE_KEY)) continue;
+
+        hash = table_key_combine( hash, read_slot_int( tv->table, slot, i ), n++ );
+    }
+    return hash;
+}
+
+static unsigned table_data_key( const LibmsiTableView *tv, const unsigned *data )
+{
+    unsigned i, n = 0, hash = 0;
+
+    for (i = 0; i < tv->num_cols; i++)
+    {
+        if (!(tv->columns[i].type & MSITYPE_KEY)) continue;
+
+        hash = table_key_combine( hash, data[i], n++ );
+    }
+    return hash;
+}
+
+static unsigned table_build_key_index( LibmsiTableView *tv )
 {
-    LibmsiTable *table;
-    unsigned size, offset, old_count;
-    unsigned n;
-
-    table = find_cached_table( db, name );
-    old_count = table->col_count;
-    msi_free_colinfo( table->colinfo, table->col_count );
-    msi_free( table->colinfo );
-    table->colinfo = NULL;
+    LibmsiTable *table = tv->table;
+    unsigned i, slot;
 
-    table_get_column_info( db, name, &table->colinfo, &table->col_count );
-    if (!table->col_count) return;
+    if (table->key_index)
+        return LIBMSI_RESULT_SUCCESS;
 
-    size = msi_table_get_row_size( db, table->colinfo, table->col_count, LONG_STR_BYTES );
-    offset = table->colinfo[table->col_count - 1].offset;
+    table->key_index = column_hash_alloc( table->row_count );
+    if (!table->key_index)
+        return LIBMSI_RESULT_OUTOFMEMORY;
 
-    for ( n = 0; n < table->row_count; n++ )
+    for (i = 0; i < table->row_count; i++)
     {
-        table->data[n] = msi_realloc( table->data[n], size );
-        if (old_count < table->col_count)
-            memset( &table->data[n][offset], 0, size - offset );
+        slot = table_slot( table, i );
+        column_hash_add( table->key_index, table_slot_key( tv, slot ), slot );
     }
+
+    return LIBMSI_RESULT_SUCCESS;
 }
 
-/* try to find the table name in the _Tables table */
-bool table_view_exists( LibmsiDatabase *db, const char *name )
+/* update the indexes and persistence bits for a row moving to another slot */
+static void table_move_slot( LibmsiTableView *tv, unsigned from, unsigned to )
 {
-    unsigned r, table_id, i;
-    LibmsiTable *table;
+    LibmsiTable *t = tv->table;
+    unsigned i;
 
-    if( !strcmp( name, szTables ) || !strcmp( name, szColumns ) ||
-        !strcmp( name, szStreams ) || !strcmp( name, szStorages ) )
-        return true;
+    for (i = 0; i < tv->num_cols; i++)
+    {
+        LibmsiColumnInfo *col = &tv->columns[i];
 
-    r = _libmsi_id_from_string_utf8( db->strings, name, &table_id );
-    if( r != LIBMSI_RESULT_SUCCESS )
+        if (!col->hash_table)
+            continue;
+
+        column_hash_relocate( col->hash_table, read_slot_int( t, from, i ), from, to );
+    }
+
+    if (t->key_index)
+        column_hash_relocate( t->key_index, table_slot_key( tv, from ), from, to );
+
+    table_set_slot_persistent( t, to, table_slot_persistent( t, from ) );
+
+    if (t->stream_names)
     {
-        TRACE("Couldn't find id for %s\n", debugstr_a(name));
-        return false;
+        t->stream_names[to] = t->stream_names[from];
+        t->stream_names[from] = NULL;
     }
+}
 
-    r = get_table( db, szTables, &table );
-    if( r != LIBMSI_RESULT_SUCCESS )
+/* move the gap so that it starts at the given row */
+static void table_move_gap( LibmsiTableView *tv, unsigned row )
+{
+    LibmsiTable *t = tv->table;
+    unsigned gap = t->row_alloc - t->row_count;
+    unsigned from, to, count, i;
+
+    /* without unused slots every row is in the slot of the same number */
+    if (!gap || row == t->gap_start)
     {
-        g_critical("table %s not available\n", debugstr_a(szTables));
-        return false;
+        t->gap_start = row;
+        return;
     }
 
-    for( i = 0; i < table->row_count; i++ )
+    if (row < t->gap_start)
     {
-        if( read_table_int( table->data, i, 0, LONG_STR_BYTES ) == table_id )
-            return true;
+        from = row;
+        to = row + gap;
+        count = t->gap_start - row;
+
+        /* the destination may overlap the rows still to be moved */
+        for (i = count; i > 0; i--)
+            table_move_slot( tv, from + i - 1, to + i - 1 );
     }
+    else
+    {
+        from = t->gap_start + gap;
+        to = t->gap_start;
+        count = row - t->gap_start;
 
-    return false;
-}
+        for (i = 0; i < count; i++)
+            table_move_slot( tv, from + i, to + i );
+    }
 
-/* below is the query interface to a table */
+    for (i = 0; i < t->col_count; i++)
+    {
+        LibmsiColumnData *c = &t->data[i];
+        unsigned size = c->wide ? 4 : 2;
 
-typedef struct _LibmsiTableView
-{
-    LibmsiView        view;
-    LibmsiDatabase   *db;
-    LibmsiTable      *table;
-    LibmsiColumnInfo *columns;
-    unsigned           num_cols;
-    unsigned           row_size;
-    char          name[1];
-} LibmsiTableView;
+        memmove( (uint8_t *)c->values + (size_t)to * size, (uint8_t *)c->values + (size_t)from * size,
+                 (size_t)count * size );
+    }
+    t->gap_start = row;
+}
 
 static unsigned table_view_fetch_int( LibmsiView *view, unsigned row, unsigned col, unsigned *val )
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
-    unsigned offset, n;
+    unsigned n;
 
     if( !tv->table )
         return LIBMSI_RESULT_INVALID_PARAMETER;
@@ -1037,9 +1808,9 @@ static unsigned table_view_fetch_int( LibmsiView *view, unsigned row, unsigned c
     if( row >= tv->table->row_count )
         return NO_MORE_ITEMS;
 
-    if( tv->columns[col-1].offset >= tv->row_size )
+    if( col > tv->table->col_count )
     {
-        g_critical("Stuffed up %d >= %d\n", tv->columns[col-1].offset, tv->row_size );
+        g_critical("Stuffed up %d >= %d\n", col - 1, tv->table->col_count );
         g_critical("%p %p\n", tv, tv->columns );
         return LIBMSI_RESULT_FUNCTION_FAILED;
     }
@@ -1051,8 +1822,7 @@ static unsigned table_view_fetch_int( LibmsiView *view, unsigned row, unsigned c
         return LIBMSI_RESULT_FUNCTION_FAILED;
     }
 
-    offset = tv->columns[col-1].offset;
-    *val = read_table_int(tv->table->data, row, offset, n);
+    *val = read_table_int( tv->table, row, col - 1 );
 
     /* TRACE("Data [%d][%d] = %d\n", row, col, *val ); */
 
@@ -1146,6 +1916,56 @@ err:
     return r;
 }
 
+/* the stream name of a row and, if encname is not NULL, its encoded form,
+ * built once per slot and kept until the row's keys change */
+static unsigned table_stream_name( const LibmsiTableView *tv, unsigned row, const char **pstname,
+                                   const char **encname )
+{
+    LibmsiTable *t = tv->table;
+    unsigned slot, r;
+    size_t len, size;
+    char *stname, *names;
+
+    if (row >= t->row_count)
+        return LIBMSI_RESULT_INVALID_PARAMETER;
+
+    if (!t->stream_names)
+    {
+        t->stream_names = msi_alloc_zero( (size_t)t->row_alloc * sizeof(char *) );
+        if (!t->stream_names)
+            return LIBMSI_RESULT_OUTOFMEMORY;
+    }
+
+    slot = table_slot( t, row );
+    if (!t->stream_names[slot])
+    {
+        r = msi_stream_name( tv, row, &stname );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            return r;
+
+        /* the encoded name follows the name in the same block */
+        len = strlen( stname ) + 1;
+        size = (len + 1) * 3;
+        names = msi_realloc( stname, len + size );
+        if (!names)
+        {
+            msi_free( stname );
+            return LIBMSI_RESULT_OUTOFMEMORY;
+        }
+        if (!encode_streamname_buf( false, names, names + len, size ))
+        {
+            msi_free( names );
+            return LIBMSI_RESULT_FUNCTION_FAILED;
+        }
+        t->stream_names[slot] = names;
+    }
+
+    *pstname = t->stream_names[slot];
+    if (encname)
+        *encname = *pstname + strlen( *pstname ) + 1;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 /*
  * We need a special case for streams, as we need to reference column with
  * the name of the stream in the same table, and the table name
@@ -1155,35 +1975,32 @@ static unsigned table_view_fetch_stream( LibmsiView *view, unsigned row, unsigne
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
     unsigned r;
-    char *encname;
-    char *full_name = NULL;
+    const char *full_name, *encname;
 
     if( !view->ops->fetch_int )
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
-    r = msi_stream_name( tv, row, &full_name );
+    *stm = NULL;
+    r = table_stream_name( tv, row, &full_name, &encname );
     if ( r != LIBMSI_RESULT_SUCCESS )
     {
         g_critical("fetching stream, error = %d\n", r);
         return r;
     }
 
-    encname = encode_streamname( false, full_name );
     r = msi_get_raw_stream( tv->db, encname, stm );
     if( r )
         g_critical("fetching stream %s, error = %d\n",debugstr_a(full_name), r);
 
     if (*stm)
-        g_object_set_data_full (G_OBJECT (*stm), "stname", full_name, g_free);
-    else
-        msi_free( full_name );
-    msi_free( encname );
+        g_object_set_data_full (G_OBJECT (*stm), "stname", g_strdup(full_name), g_free);
     return r;
 }
 
 static unsigned table_view_set_int( LibmsiTableView *tv, unsigned row, unsigned col, unsigned val )
 {
-    unsigned offset, n, i;
+    unsigned n, slot, old_key = 0;
+    bool key_index;
 
     if( !tv->table )
         return LIBMSI_RESULT_INVALID_PARAMETER;
@@ -1194,16 +2011,13 @@ static unsigned table_view_set_int( LibmsiTableView *tv, unsigned row, unsigned
     if( row >= tv->table->row_count )
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
-    if( tv->columns[col-1].offset >= tv->row_size )
+    if( col > tv->table->col_count )
     {
-        g_critical("Stuffed up %d >= %d\n", tv->columns[col-1].offset, tv->row_size );
+        g_critical("Stuffed up %d >= %d\n", col - 1, tv->table->col_count );
         g_critical("%p %p\n", tv, tv->columns );
         return LIBMSI_RESULT_FUNCTION_FAILED;
     }
 
-    msi_free( tv->columns[col-1].hash_table );
-    tv->columns[col-1].hash_table = NULL;
-
     n = bytes_per_column( tv->db, &tv->columns[col - 1], LONG_STR_BYTES );
     if ( n != 2 && n != 3 && n != 4 )
     {
@@ -1211,9 +2025,42 @@ static unsigned table_view_set_int( LibmsiTableView *tv, unsigned row, unsigned
         return LIBMSI_RESULT_FUNCTION_FAILED;
     }
 
-    offset = tv->columns[col-1].offset;
-    for ( i = 0; i < n; i++ )
-        tv->table->data[row][offset + i] = (val >> i * 8) & 0xff;
+    /* the column only holds n bytes */
+    if ( n < 4 )
+        val &= (1u << n * 8) - 1;
+
+    slot = table_slot( tv->table, row );
+    if ( tv->columns[col-1].hash_table )
+    {
+        unsigned old_val = read_slot_int( tv->table, slot, col - 1 );
+
+        if ( old_val != val )
+        {
+            column_hash_remove( tv->columns[col-1].hash_table, old_val, slot );
+            column_hash_insert( &tv->columns[col-1].hash_table, val, slot );
+        }
+    }
+
+    key_index = (tv->columns[col-1].type & MSITYPE_KEY) && tv->table->key_index;
+    if ( key_index )
+        old_key = table_slot_key( tv, slot );
+
+    write_slot_int( tv->table, slot, col - 1, val );
+    tv->table->dirty = true;
+
+    if ( tv->columns[col-1].type & MSITYPE_KEY )
+        forget_stream_name( tv->table, slot );
+
+    if ( key_index )
+    {
+        unsigned new_key = table_slot_key( tv, slot );
+
+        if ( old_key != new_key )
+        {
+            column_hash_remove( tv->table->key_index, old_key, slot );
+            column_hash_insert( &tv->table->key_index, new_key, slot );
+        }
+    }
 
     return LIBMSI_RESULT_SUCCESS;
 }
@@ -1329,7 +2176,7 @@ static unsigned table_view_set_row( LibmsiView *view, unsigned row, LibmsiRecord
             continue;
 
         persistent = (tv->table->persistent != LIBMSI_CONDITION_FALSE) &&
-                     (tv->table->data_persistent[row]);
+                     table_slot_persistent( tv->table, table_slot( tv->table, row ) );
         /* FIXME: should we allow updating keys? */
 
         val = 0;
@@ -1339,7 +2186,7 @@ static unsigned table_view_set_row( LibmsiView *view, unsigned row, LibmsiRecord
             if ( MSITYPE_IS_BINARY(tv->columns[ i ].type) )
             {
                 GsfInput *stm;
-                char *stname;
+                const char *stname;
 
                 if ( r != LIBMSI_RESULT_SUCCESS )
                     return LIBMSI_RESULT_FUNCTION_FAILED;
@@ -1348,7 +2195,7 @@ static unsigned table_view_set_row( LibmsiView *view, unsigned row, LibmsiRecord
                 if ( r != LIBMSI_RESULT_SUCCESS )
                     return r;
 
-                r = msi_stream_name( tv, row, &stname );
+                r = table_stream_name( tv, row, &stname, NULL );
                 if ( r != LIBMSI_RESULT_SUCCESS )
                 {
                     g_object_unref(G_OBJECT(stm));
@@ -1357,7 +2204,6 @@ static unsigned table_view_set_row( LibmsiView *view, unsigned row, LibmsiRecord
 
                 r = _libmsi_add_stream( tv->db, stname, stm );
                 g_object_unref(G_OBJECT(stm));
-                msi_free ( stname );
 
                 if ( r != LIBMSI_RESULT_SUCCESS )
                     return r;
@@ -1396,58 +2242,50 @@ static unsigned table_view_set_row( LibmsiView *view, unsigned row, LibmsiRecord
 static unsigned table_create_new_row( LibmsiView *view, unsigned *num, bool temporary )
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
-    uint8_t **p, *row;
-    bool *b;
-    unsigned sz;
-    uint8_t ***data_ptr;
-    bool **data_persist_ptr;
-    unsigned *row_count;
+    LibmsiTable *t;
+    unsigned slot, i;
 
     TRACE("%p %s\n", view, temporary ? "true" : "false");
 
     if( !tv->table )
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
-    row = msi_alloc_zero( tv->row_size );
-    if( !row )
-        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
-
-    row_count = &tv->table->row_count;
-    data_ptr = &tv->table->data;
-    data_persist_ptr = &tv->table->data_persistent;
+    t = tv->table;
     if (*num == -1)
-        *num = tv->table->row_count;
+        *num = t->row_count;
 
-    sz = (*row_count + 1) * sizeof (uint8_t*);
-    if( *data_ptr )
-        p = msi_realloc( *data_ptr, sz );
-    else
-        p = msi_alloc( sz );
-    if( !p )
+    if (t->row_count == t->row_alloc)
     {
-        msi_free( row );
-        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
-    }
+        /* the buffer is full, so every row is in the slot of the same
+         * number and the gap can be restarted at the end */
+        unsigned alloc = t->row_alloc ? t->row_alloc * 2 : 16;
 
-    sz = (*row_count + 1) * sizeof (bool);
-    if( *data_persist_ptr )
-        b = msi_realloc( *data_persist_ptr, sz );
-    else
-        b = msi_alloc( sz );
-    if( !b )
-    {
-        msi_free( row );
-        msi_free( p );
-        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+        if (alloc <= t->row_alloc)
+            return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+
+        if (table_resize_data( t, alloc ) != LIBMSI_RESULT_SUCCESS)
+            return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
     }
 
-    *data_ptr = p;
-    (*data_ptr)[*row_count] = row;
+    table_move_gap( tv, *num );
+    slot = t->gap_start++;
+    for (i = 0; i < t->col_count; i++)
+        write_slot_int( t, slot, i, 0 );
+    table_set_slot_persistent( t, slot, !temporary );
+    t->row_count++;
+    t->dirty = true;
+
+    /* add the empty row to the indexes */
+    for (i = 0; i < tv->num_cols; i++)
+    {
+        LibmsiColumnInfo *col = &tv->columns[i];
 
-    *data_persist_ptr = b;
-    (*data_persist_ptr)[*row_count] = !temporary;
+        if (col->hash_table)
+            column_hash_insert( &col->hash_table, 0, slot );
+    }
 
-    (*row_count)++;
+    if (t->key_index)
+        column_hash_insert( &t->key_index, table_slot_key( tv, slot ), slot );
 
     return LIBMSI_RESULT_SUCCESS;
 }
@@ -1568,29 +2406,25 @@ static unsigned table_validate_new( LibmsiTableView *tv, LibmsiRecord *rec, unsi
     return LIBMSI_RESULT_SUCCESS;
 }
 
-static int compare_record( LibmsiTableView *tv, unsigned row, LibmsiRecord *rec )
+/* keys holds the encoded key columns of the record, up to fail_col which
+ * is the first key column that could not be encoded */
+static int compare_record( LibmsiTableView *tv, unsigned row, const unsigned *keys, unsigned fail_col )
 {
-    unsigned r, i, ivalue, x;
+    unsigned i, x;
 
     for (i = 0; i < tv->num_cols; i++ )
     {
         if (!(tv->columns[i].type & MSITYPE_KEY)) continue;
 
-        r = get_table_value_from_record( tv, rec, i + 1, &ivalue );
-        if (r != LIBMSI_RESULT_SUCCESS)
+        if (i == fail_col)
             return 1;
 
-        r = table_view_fetch_int( &tv->view, row, i + 1, &x );
-        if (r != LIBMSI_RESULT_SUCCESS)
-        {
-            g_warning("table_view_fetch_int should not fail here %u\n", r);
-            return -1;
-        }
-        if (ivalue > x)
+        x = read_table_int( tv->table, row, i );
+        if (keys[i] > x)
         {
             return 1;
         }
-        else if (ivalue == x)
+        else if (keys[i] == x)
         {
             if (i < tv->num_cols - 1) continue;
             return 0;
@@ -1604,13 +2438,27 @@ static int compare_record( LibmsiTableView *tv, unsigned row, LibmsiRecord *rec
 static int find_insert_index( LibmsiTableView *tv, LibmsiRecord *rec )
 {
     int idx, c, low = 0, high = tv->table->row_count - 1;
+    unsigned fail_col, *keys;
 
     TRACE("%p %p\n", tv, rec);
 
+    keys = msi_alloc( tv->num_cols * sizeof(unsigned) );
+    if (!keys)
+        return tv->table->row_count;
+
+    /* encode the key of the record once for the whole search */
+    for (fail_col = 0; fail_col < tv->num_cols; fail_col++)
+    {
+        if (!(tv->columns[fail_col].type & MSITYPE_KEY)) continue;
+
+        if (get_table_value_from_record( tv, rec, fail_col + 1, &keys[fail_col] ) != LIBMSI_RESULT_SUCCESS)
+            break;
+    }
+
     while (low <= high)
     {
         idx = (low + high) / 2;
-        c = compare_record( tv, idx, rec );
+        c = compare_record( tv, idx, keys, fail_col );
 
         if (c < 0)
             high = idx - 1;
@@ -1619,17 +2467,19 @@ static int find_insert_index( LibmsiTableView *tv, LibmsiRecord *rec )
         else
         {
             TRACE("found %u\n", idx);
+            msi_free( keys );
             return idx;
         }
     }
     TRACE("found %u\n", high + 1);
+    msi_free( keys );
     return high + 1;
 }
 
 static unsigned table_view_insert_row( LibmsiView *view, LibmsiRecord *rec, unsigned row, bool temporary )
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
-    unsigned i, r;
+    unsigned r;
 
     TRACE("%p %p %s\n", tv, rec, temporary ? "true" : "false" );
 
@@ -1646,23 +2496,13 @@ static unsigned table_view_insert_row( LibmsiView *view, LibmsiRecord *rec, unsi
     if( r != LIBMSI_RESULT_SUCCESS )
         return r;
 
-    /* shift the rows to make room for the new row */
-    for (i = tv->table->row_count - 1; i > row; i--)
-    {
-        memmove(&(tv->table->data[i][0]),
-                &(tv->table->data[i - 1][0]), tv->row_size);
-        tv->table->data_persistent[i] = tv->table->data_persistent[i - 1];
-    }
-
-    /* Re-set the persistence flag */
-    tv->table->data_persistent[row] = !temporary;
     return table_view_set_row( view, row, rec, (1<<tv->num_cols) - 1 );
 }
 
 static unsigned table_view_delete_row( LibmsiView *view, unsigned row )
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
-    unsigned r, num_rows, num_cols, i;
+    unsigned r, num_rows, num_cols, i, slot;
 
     TRACE("%p %d\n", tv, row);
 
@@ -1676,23 +2516,27 @@ static unsigned table_view_delete_row( LibmsiView *view, unsigned row )
     if ( row >= num_rows )
         return LIBMSI_RESULT_FUNCTION_FAILED;
 
-    num_rows = tv->table->row_count;
-    tv->table->row_count--;
+    /* bring the row next to the gap and release its slot */
+    table_move_gap( tv, row + 1 );
+    slot = tv->table->gap_start - 1;
 
-    /* reset the hash tables */
     for (i = 0; i < tv->num_cols; i++)
     {
-        msi_free( tv->columns[i].hash_table );
-        tv->columns[i].hash_table = NULL;
-    }
+        LibmsiColumnInfo *col = &tv->columns[i];
 
-    for (i = row + 1; i < num_rows; i++)
-    {
-        memcpy(tv->table->data[i - 1], tv->table->data[i], tv->row_size);
-        tv->table->data_persistent[i - 1] = tv->table->data_persistent[i];
+        if (!col->hash_table)
+            continue;
+
+        column_hash_remove( col->hash_table, read_slot_int( tv->table, slot, i ), slot );
     }
 
-    msi_free(tv->table->data[num_rows - 1]);
+    if (tv->table->key_index)
+        column_hash_remove( tv->table->key_index, table_slot_key( tv, slot ), slot );
+
+    forget_stream_name( tv->table, slot );
+    tv->table->gap_start--;
+    tv->table->row_count--;
+    tv->table->dirty = true;
 
     return LIBMSI_RESULT_SUCCESS;
 }
@@ -1715,7 +2559,8 @@ static unsigned table_view_find_matching_rows( LibmsiView *view, unsigned col,
     unsigned val, unsigned *row, MSIITERHANDLE *handle )
 {
     LibmsiTableView *tv = (LibmsiTableView*)view;
-    const LibmsiColumnHashEntry *entry;
+    const LibmsiColumnHash *hash;
+    unsigned i;
 
     TRACE("%p, %d, %u, %p\n", view, col, val, *handle);
 
@@ -1725,69 +2570,57 @@ static unsigned table_view_find_matching_rows( LibmsiView *view, unsigned col,
     if( (col==0) || (col > tv->num_cols) )
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
-    if( !tv->columns[col-1].hash_table )
+    if( (tv->columns[col-1].type & MSITYPE_KEY) && table_key_count( tv ) == 1 )
+    {
+        /* the primary key index is keyed by the value of the only key column */
+        if( table_build_key_index( tv ) != LIBMSI_RESULT_SUCCESS )
+            return LIBMSI_RESULT_OUTOFMEMORY;
+        hash = tv->table->key_index;
+    }
+    else if( !tv->columns[col-1].hash_table )
     {
-        unsigned i;
         unsigned num_rows = tv->table->row_count;
-        LibmsiColumnHashEntry **hash_table;
-        LibmsiColumnHashEntry *new_entry;
+        LibmsiColumnHash *new_hash;
 
-        if( tv->columns[col-1].offset >= tv->row_size )
+        if( col > tv->table->col_count )
         {
-            g_critical("Stuffed up %d >= %d\n", tv->columns[col-1].offset, tv->row_size );
+            g_critical("Stuffed up %d >= %d\n", col - 1, tv->table->col_count );
             g_critical("%p %p\n", tv, tv->columns );
             return LIBMSI_RESULT_FUNCTION_FAILED;
         }
 
-        /* allocate contiguous memory for the table and its entries so we
-         * don't have to do an expensive cleanup */
-        hash_table = msi_alloc(LibmsiTable_HASH_TABLE_SIZE * sizeof(LibmsiColumnHashEntry*) +
-            num_rows * sizeof(LibmsiColumnHashEntry));
-        if (!hash_table)
+        new_hash = column_hash_alloc( num_rows );
+        if (!new_hash)
             return LIBMSI_RESULT_OUTOFMEMORY;
 
-        memset(hash_table, 0, LibmsiTable_HASH_TABLE_SIZE * sizeof(LibmsiColumnHashEntry*));
-        tv->columns[col-1].hash_table = hash_table;
-
-        new_entry = (LibmsiColumnHashEntry *)(hash_table + LibmsiTable_HASH_TABLE_SIZE);
-
-        for (i = 0; i < num_rows; i++, new_entry++)
+        for (i = 0; i < num_rows; i++)
         {
-            unsigned row_value;
-
-            if (view->ops->fetch_int( view, i, col, &row_value ) != LIBMSI_RESULT_SUCCESS)
-                continue;
-
-            new_entry->next = NULL;
-            new_entry->value = row_value;
-            new_entry->row = i;
-            if (hash_table[row_value % LibmsiTable_HASH_TABLE_SIZE])
-            {
-                LibmsiColumnHashEntry *prev_entry = hash_table[row_value % LibmsiTable_HASH_TABLE_SIZE];
-                while (prev_entry->next)
-                    prev_entry = prev_entry->next;
-                prev_entry->next = new_entry;
-            }
-            else
-                hash_table[row_value % LibmsiTable_HASH_TABLE_SIZE] = new_entry;
+            unsigned slot = table_slot( tv->table, i );
+            column_hash_add( new_hash, read_slot_int( tv->table, slot, col - 1 ), slot );
         }
+
+        hash = tv->columns[col-1].hash_table = new_hash;
     }
+    else
+        hash = tv->columns[col-1].hash_table;
 
     if( !*handle )
-        entry = tv->columns[col-1].hash_table[val % LibmsiTable_HASH_TABLE_SIZE];
+        i = column_hash_bucket( val ) & hash->mask;
     else
-        entry = (*handle)->next;
+        i = (*handle - hash->entries + 1) & hash->mask;
 
-    while (entry && entry->value != val)
-        entry = entry->next;
-
-    *handle = entry;
-    if (!entry)
-        return NO_MORE_ITEMS;
-
-    *row = entry->row;
+    for (; hash->entries[i].slot != LibmsiTable_HASH_EMPTY; i = (i + 1) & hash->mask)
+    {
+        if (hash->entries[i].value == val)
+        {
+            *handle = &hash->entries[i];
+            *row = table_slot_row( tv->table, hash->entries[i].slot );
+            return LIBMSI_RESULT_SUCCESS;
+        }
+    }
 
-    return LIBMSI_RESULT_SUCCESS;
+    *handle = NULL;
+    return NO_MORE_ITEMS;
 }
 
 static unsigned table_view_add_ref(LibmsiView *view)
@@ -1988,6 +2821,8 @@ static const LibmsiViewOps table_ops =
     table_view_remove_column,
     NULL,
     table_view_drop,
+    NULL,
+    NULL,
 };
 
 unsigned table_view_create( LibmsiDatabase *db, const char *name, LibmsiView **view )
@@ -2032,10 +2867,136 @@ unsigned table_view_create( LibmsiDatabase *db, const char *name, LibmsiView **v
     return LIBMSI_RESULT_SUCCESS;
 }
 
-unsigned _libmsi_database_commit_tables( LibmsiDatabase *db, unsigned bytes_per_strref )
+static bool table_is_saved( const LibmsiTable *t )
+{
+    return t->persistent != LIBMSI_CONDITION_FALSE &&
+           table_saved_rows( t ) == t->row_count;
+}
+
+static unsigned copy_table_stream( LibmsiDatabase *db, const LibmsiTable *t, bool *copied )
+{
+    unsigned ret = LIBMSI_RESULT_FUNCTION_FAILED;
+    GsfInput *in;
+    GsfOutput *out;
+
+    *copied = false;
+    if ( !db->infile || !db->outfile || !t->encname[0] )
+        return LIBMSI_RESULT_SUCCESS;
+
+    in = gsf_infile_child_by_name( db->infile, t->encname );
+    if ( !in )
+        return LIBMSI_RESULT_SUCCESS;
+
+    TRACE("copying %s\n", debugstr_a(t->name));
+
+    out = gsf_outfile_new_child( db->outfile, t->encname, false );
+    if ( out )
+    {
+        if ( copy_stream_data( in, out ) )
+        {
+            *copied = true;
+            ret = LIBMSI_RESULT_SUCCESS;
+        }
+        gsf_output_close( out );
+        g_object_unref( G_OBJECT(out) );
+    }
+    g_object_unref( G_OBJECT(in) );
+    return ret;
+}
+
+/* read a table that isn't loaded yet into a copy the caller frees.  Unlike
+ * get_table, this leaves the list of cached tables alone, even when the
+ * table can't be loaded. */
+static unsigned load_table_copy( LibmsiDatabase *db, const LibmsiTable *table, LibmsiTable **ret )
+{
+    LibmsiTable *t;
+    unsigned r;
+
+    t = msi_alloc_zero( sizeof(LibmsiTable) + strlen( table->name ) * sizeof(char) );
+    if (!t)
+        return LIBMSI_RESULT_NOT_ENOUGH_MEMORY;
+
+    t->persistent = table->persistent;
+    strcpy( t->name, table->name );
+    memcpy( t->encname, table->encname, sizeof(t->encname) );
+
+    r = table_get_column_info( db, t->name, &t->colinfo, &t->col_count );
+    if (r == LIBMSI_RESULT_SUCCESS)
+        r = read_table_from_storage( db, t, db->infile );
+    if (r != LIBMSI_RESULT_SUCCESS)
+    {
+        free_table( t );
+        return r;
+    }
+    *ret = t;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static void count_table_string_refs( const LibmsiTable *t, unsigned *refs, unsigned count )
+{
+    unsigned i, j, rows, id;
+
+    rows = table_saved_rows( t );
+    for (j = 0; j < t->col_count; j++)
+    {
+        if (!column_is_string( &t->colinfo[j] ))
+            continue;
+        for (i = 0; i < rows; i++)
+        {
+            id = read_table_int( t, i, j );
+            if (id && id < count && refs[id] < 0xffff)
+                refs[id]++;
+        }
+    }
+}
+
+/* count the references to each string from the rows that are saved, for
+ * compacting the string pool.  Tables that aren't loaded are read into a
+ * copy, so a table that can't be loaded stays in the list to be copied
+ * unchanged by a commit that doesn't compact; counting fails, as the
+ * strings of that table could not be renumbered. */
+unsigned _libmsi_database_count_string_refs( LibmsiDatabase *db, unsigned *refs, unsigned count )
+{
+    unsigned r;
+    LibmsiTable *table;
+    LibmsiTable *t;
+
+    /* the column info of every table is read from these */
+    get_table( db, szTables, &t );
+    get_table( db, szColumns, &t );
+
+    LIST_FOR_EACH_ENTRY( table, &db->tables, LibmsiTable, entry )
+    {
+        if( table->persistent == LIBMSI_CONDITION_FALSE )
+            continue;
+
+        t = table;
+        if( !t->colinfo )
+        {
+            r = load_table_copy( db, table, &t );
+            if( r != LIBMSI_RESULT_SUCCESS )
+            {
+                g_warning("failed to load table %s (r=%08x)\n",
+                          debugstr_a(table->name), r);
+                return r;
+            }
+        }
+
+        count_table_string_refs( t, refs, count );
+        if( t != table )
+            free_table( t );
+    }
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+/* map, if not NULL, renumbers the strings of every table.  A table that
+ * isn't loaded is written from a copy that isn't kept, so that compacting
+ * doesn't load the whole database. */
+unsigned _libmsi_database_commit_tables( LibmsiDatabase *db, unsigned bytes_per_strref,
+                                         const unsigned *map )
 {
     unsigned r = LIBMSI_RESULT_SUCCESS;
-    LibmsiTable *table, *table2;
+    LibmsiTable *table;
     LibmsiTable *t;
 
     TRACE("%p\n",db);
@@ -2043,24 +3004,50 @@ unsigned _libmsi_database_commit_tables( LibmsiDatabase *db, unsigned bytes_per_
     /* Ensure the Tables stream is written.  */
     get_table( db, szTables, &t );
 
-    LIST_FOR_EACH_ENTRY_SAFE( table, table2, &db->tables, LibmsiTable, entry )
+    LIST_FOR_EACH_ENTRY( table, &db->tables, LibmsiTable, entry )
     {
-        r = get_table( db, table->name, &t );
+        /* copy the stream of an unmodified table as it is, as long as the
+         * string references in it keep the same size and ids */
+        if( !map && !db->string_ids && !table->dirty &&
+            bytes_per_strref == db->bytes_per_strref )
+        {
+            bool copied;
+
+            r = copy_table_stream( db, table, &copied );
+            if( r != LIBMSI_RESULT_SUCCESS )
+            {
+                g_warning("failed to copy table %s (r=%08x)\n",
+                      debugstr_a(table->name), r);
+                return r;
+            }
+            if( copied )
+                continue;
+        }
+
+        if( table->colinfo )
+            t = table;
+        else
+            r = load_table_copy( db, table, &t );
         if( r != LIBMSI_RESULT_SUCCESS )
         {
             g_warning("failed to load table %s (r=%08x)\n",
                   debugstr_a(table->name), r);
             return r;
         }
-        r = save_table( db, table, bytes_per_strref );
+        r = save_table( db, t, bytes_per_strref, map );
+        if( t != table )
+            free_table( t );
         if( r != LIBMSI_RESULT_SUCCESS )
         {
             g_warning("failed to save table %s (r=%08x)\n",
                   debugstr_a(table->name), r);
             return r;
         }
-        list_remove(&table->entry);
-        free_table(table);
+
+        /* the table stays in memory; it only matches the committed
+         * stream if none of its rows were left out */
+        if( t == table )
+            table->dirty = !table_is_saved( table );
     }
 
     return r;
@@ -2346,19 +3333,47 @@ static unsigned msi_row_matches( LibmsiTableView *tv, unsigned row, const unsign
 
 static unsigned msi_table_find_row( LibmsiTableView *tv, LibmsiRecord *rec, unsigned *row, unsigned *column )
 {
-    unsigned i, r = LIBMSI_RESULT_FUNCTION_FAILED, *data;
+    unsigned i, key, found, r = LIBMSI_RESULT_FUNCTION_FAILED, *data;
+    const LibmsiColumnHash *hash;
 
     data = msi_record_to_row( tv, rec );
     if( !data )
         return r;
-    for( i = 0; i < tv->table->row_count; i++ )
+
+    if( table_build_key_index( tv ) != LIBMSI_RESULT_SUCCESS )
     {
-        r = msi_row_matches( tv, i, data, column );
-        if( r == LIBMSI_RESULT_SUCCESS )
+        for( i = 0; i < tv->table->row_count; i++ )
         {
-            *row = i;
-            break;
+            r = msi_row_matches( tv, i, data, column );
+            if( r == LIBMSI_RESULT_SUCCESS )
+            {
+                *row = i;
+                break;
+            }
         }
+        msi_free( data );
+        return r;
+    }
+
+    /* keys are normally unique, but return the first matching row anyway */
+    key = table_data_key( tv, data );
+    hash = tv->table->key_index;
+    found = LibmsiTable_HASH_EMPTY;
+    for( i = column_hash_bucket( key ) & hash->mask;
+         hash->entries[i].slot != LibmsiTable_HASH_EMPTY;
+         i = (i + 1) & hash->mask )
+    {
+        unsigned n = table_slot_row( tv->table, hash->entries[i].slot );
+
+        if( hash->entries[i].value == key && n < found &&
+            msi_row_matches( tv, n, data, NULL ) == LIBMSI_RESULT_SUCCESS )
+            found = n;
+    }
+
+    if( found != LibmsiTable_HASH_EMPTY )
+    {
+        r = msi_row_matches( tv, found, data, column );
+        *row = found;
     }
     msi_free( data );
     return r;
@@ -2564,7 +3579,7 @@ unsigned msi_table_apply_transform( LibmsiDatabase *db, GsfInfile *stg )
 
     TRACE("%p %p\n", db, stg );
 
-    strings = msi_load_string_table( stg, &bytes_per_strref );
+    strings = msi_load_string_table( stg, false, &bytes_per_strref );
     if( !strings )
         goto end;
 
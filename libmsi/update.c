@@ -184,6 +184,18 @@ static unsigned update_view_find_matching_rows( LibmsiView *view, unsigned col,
     return LIBMSI_RESULT_FUNCTION_FAILED;
 }
 
+static unsigned update_view_explain( LibmsiView *view, GString *plan )
+{
+    LibmsiUpdateView *uv = (LibmsiUpdateView*)view;
+
+    TRACE("%p %p\n", uv, plan );
+
+    if( !uv->wv )
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return msi_view_explain( uv->wv, plan );
+}
+
 
 static const LibmsiViewOps update_ops =
 {
@@ -204,6 +216,9 @@ static const LibmsiViewOps update_ops =
     NULL,
     NULL,
     NULL,
+    NULL,
+    update_view_explain,
+    NULL,
 };
 
 unsigned update_view_create( LibmsiDatabase *db, LibmsiView **view, char *table,
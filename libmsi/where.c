@@ -36,6 +36,26 @@ typedef struct _LibmsiRowEntry
     unsigned values[1];
 } LibmsiRowEntry;
 
+/* the rows of a joined table hashed by the value of the column it is
+ * compared to another table with.  Rows are found by the value of probe,
+ * a column of a table earlier in the join order. */
+typedef struct _LibmsiJoinHash
+{
+    const union ext_column *probe;
+    int probe_type;
+    unsigned mask;
+    unsigned *buckets;   /* first row in each bucket plus one */
+    unsigned *next;      /* next row in the same bucket plus one */
+    unsigned *keys;
+} LibmsiJoinHash;
+
+/* a part of the condition that is AND-ed with the rest */
+typedef struct _LibmsiConjunct
+{
+    struct expr *expr;
+    unsigned rec_index;             /* record fields used by the parts before it */
+} LibmsiConjunct;
+
 typedef struct tagJOINTABLE
 {
     struct tagJOINTABLE *next;
@@ -43,8 +63,21 @@ typedef struct tagJOINTABLE
     unsigned col_count;
     unsigned row_count;
     unsigned table_index;
+    unsigned key_count;
+    int access;                     /* how the rows are found, see plan_joins */
+    const struct expr *key_column;  /* the column they are found by */
+    const struct expr *key_value;   /* what that column is compared to */
+    unsigned key_field;             /* record field of a wildcard value */
+    double est_rows;                /* estimated row combinations so far */
+    LibmsiJoinHash *join;
+    LibmsiConjunct **checks;        /* conjuncts checked once a row is chosen */
+    unsigned check_count;
 } JOINTABLE;
 
+#define ACCESS_SCAN  0 /* every row is read */
+#define ACCESS_INDEX 1 /* rows are looked up with find_matching_rows */
+#define ACCESS_HASH  2 /* rows are looked up in a hash built for the query */
+
 typedef struct _LibmsiOrderInfo
 {
     unsigned col_count;
@@ -65,24 +98,60 @@ typedef struct _LibmsiWhereView
     struct expr   *cond;
     unsigned           rec_index;
     LibmsiOrderInfo  *order_info;
+    LibmsiConjunct    *conjuncts;
+    unsigned           conjunct_count;
+    LibmsiConjunct   **checks;      /* the conjuncts in join order */
+    /* a single table without ORDER BY is checked as its rows are fetched */
+    unsigned          *found;       /* the rows found so far */
+    unsigned           found_size;
+    bool               streaming;   /* more rows may still be found */
+    unsigned           next_row;    /* the next row or candidate to check */
+    unsigned          *candidates;  /* the rows found through an index, in order */
+    unsigned           candidate_count;
+    LibmsiRecord      *record;      /* the arguments the rows are checked with */
 } LibmsiWhereView;
 
 static unsigned where_view_evaluate( LibmsiWhereView *wv, const unsigned rows[],
                             struct expr *cond, int *val, LibmsiRecord *record );
+static unsigned stream_rows( LibmsiWhereView *wv, unsigned count );
 
 #define INITIAL_REORDER_SIZE 16
 
 #define INVALID_ROW_INDEX (-1)
 
+static void end_stream(LibmsiWhereView *wv)
+{
+    wv->streaming = false;
+
+    msi_free( wv->candidates );
+    wv->candidates = NULL;
+    wv->candidate_count = 0;
+
+    if (wv->record)
+        g_object_unref( wv->record );
+    wv->record = NULL;
+}
+
 static void free_reorder(LibmsiWhereView *wv)
 {
     unsigned i;
 
+    end_stream(wv);
+
     if (!wv->reorder)
         return;
 
-    for (i = 0; i < wv->row_count; i++)
-        msi_free(wv->reorder[i]);
+    if (wv->found)
+    {
+        msi_free( wv->found );
+        wv->found = NULL;
+        wv->found_size = 0;
+    }
+    else
+    {
+        for (i = 0; i < wv->row_count; i++)
+            msi_free(wv->reorder[i]);
+    }
 
     msi_free( wv->reorder );
     wv->reorder = NULL;
@@ -106,6 +175,20 @@ static unsigned init_reorder(LibmsiWhereView *wv)
 
 static inline unsigned find_row(LibmsiWhereView *wv, unsigned row, unsigned *(values[]))
 {
+    unsigned r;
+
+    if (wv->found)
+    {
+        r = stream_rows(wv, row + 1);
+        if (r != LIBMSI_RESULT_SUCCESS)
+            return r;
+        if (row >= wv->row_count)
+            return NO_MORE_ITEMS;
+
+        *values = &wv->found[row];
+        return LIBMSI_RESULT_SUCCESS;
+    }
+
     if (row >= wv->row_count)
         return NO_MORE_ITEMS;
 
@@ -454,6 +537,7 @@ static unsigned expr_eval_unary( LibmsiWhereView *wv, const unsigned rows[],
     unsigned r;
     unsigned lval;
 
+    *val = true;
     r = expr_fetch_value(&expr->left->u.column, rows, &lval);
     if(r != LIBMSI_RESULT_SUCCESS)
         return r;
@@ -512,15 +596,14 @@ static unsigned expr_eval_strcmp( LibmsiWhereView *wv, const unsigned rows[], co
 {
     int sr;
     const char *l_str, *r_str;
-    unsigned r;
+    unsigned rl, rr;
 
+    /* both sides are evaluated so that wildcards keep their numbering */
     *val = true;
-    r = expr_eval_string(wv, rows, expr->left, record, &l_str);
-    if (r == LIBMSI_RESULT_CONTINUE)
-        return r;
-    r = expr_eval_string(wv, rows, expr->right, record, &r_str);
-    if (r == LIBMSI_RESULT_CONTINUE)
-        return r;
+    rl = expr_eval_string(wv, rows, expr->left, record, &l_str);
+    rr = expr_eval_string(wv, rows, expr->right, record, &r_str);
+    if (rl == LIBMSI_RESULT_CONTINUE || rr == LIBMSI_RESULT_CONTINUE)
+        return LIBMSI_RESULT_CONTINUE;
 
     if( l_str == r_str ||
         ((!l_str || !*l_str) && (!r_str || !*r_str)) )
@@ -590,20 +673,244 @@ static unsigned where_view_evaluate( LibmsiWhereView *wv, const unsigned rows[],
     return LIBMSI_RESULT_SUCCESS;
 }
 
+/* the value an equality comparison sees for a column */
+static unsigned join_key( LibmsiWhereView *wv, int type, unsigned val )
+{
+    const char *str;
+
+    switch (type)
+    {
+    case EXPR_COL_NUMBER:
+        return val - 0x8000;
+    case EXPR_COL_NUMBER32:
+        return val - 0x80000000;
+    default:
+        /* null and empty strings are equal, and a string the pool
+         * repeats equals each of its ids */
+        str = msi_string_lookup_id( wv->db->strings, val );
+        return str && *str ? msi_string_first_id( wv->db->strings, val ) : 0;
+    }
+}
+
+static inline unsigned join_bucket( const LibmsiJoinHash *hash, unsigned key )
+{
+    key *= 0x9e3779b1;
+    return (key ^ (key >> 16)) & hash->mask;
+}
+
+static unsigned join_match( const LibmsiJoinHash *hash, unsigned entry, unsigned key )
+{
+    while (entry && hash->keys[entry - 1] != key)
+        entry = hash->next[entry - 1];
+    return entry ? entry - 1 : INVALID_ROW_INDEX;
+}
+
+/* find the first row matching the probe column of the current rows */
+static unsigned join_first_row( LibmsiWhereView *wv, const LibmsiJoinHash *hash,
+                                const unsigned rows[], unsigned *key, unsigned *row )
+{
+    unsigned r, val;
+
+    r = expr_fetch_value( hash->probe, rows, &val );
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
+    *key = join_key( wv, hash->probe_type, val );
+    *row = join_match( hash, hash->buckets[join_bucket( hash, *key )], *key );
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static inline unsigned join_next_row( const LibmsiJoinHash *hash, unsigned row, unsigned key )
+{
+    return join_match( hash, hash->next[row], key );
+}
+
+/* bias of the raw value of a numeric column */
+static inline unsigned column_bias( int type )
+{
+    return type == EXPR_COL_NUMBER32 ? 0x80000000 : 0x8000;
+}
+
+/* the raw column values equal to the value a table's index is compared
+ * to.  Returns LIBMSI_RESULT_CONTINUE when every row has to be checked. */
+static unsigned index_values( LibmsiWhereView *wv, const JOINTABLE *table, const unsigned rows[],
+                              LibmsiRecord *record, unsigned vals[2], unsigned *count )
+{
+    const struct expr *value = table->key_value;
+    int type = table->key_column->type;
+    const char *str = NULL;
+    unsigned r, val, id;
+
+    *count = 0;
+    if (value->type == EXPR_WILDCARD && !record)
+        return LIBMSI_RESULT_CONTINUE;
+
+    if (type != EXPR_COL_NUMBER_STRING)
+    {
+        switch (value->type)
+        {
+        case EXPR_UVAL:
+            val = value->u.uval;
+            break;
+        case EXPR_WILDCARD:
+            val = libmsi_record_get_int( record, table->key_field );
+            break;
+        default:
+            r = expr_fetch_value( &value->u.column, rows, &val );
+            if (r != LIBMSI_RESULT_SUCCESS)
+                return r;
+            val -= column_bias( value->type );
+            break;
+        }
+        vals[(*count)++] = val + column_bias( type );
+        return LIBMSI_RESULT_SUCCESS;
+    }
+
+    /* rows holding a repeated string under another id would be missed */
+    if (msi_string_has_duplicates( wv->db->strings ))
+        return LIBMSI_RESULT_CONTINUE;
+
+    switch (value->type)
+    {
+    case EXPR_SVAL:
+        str = value->u.sval;
+        break;
+    case EXPR_WILDCARD:
+        str = _libmsi_record_get_string_raw( record, table->key_field );
+        break;
+    default:
+        r = expr_fetch_value( &value->u.column, rows, &val );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            return r;
+        str = msi_string_lookup_id( wv->db->strings, val );
+        if (str && *str)
+        {
+            vals[(*count)++] = val;
+            return LIBMSI_RESULT_SUCCESS;
+        }
+        break;
+    }
+
+    if (str && *str)
+    {
+        /* views may add their strings to the pool as they are read */
+        if (_libmsi_id_from_string_utf8( wv->db->strings, str, &id ) != LIBMSI_RESULT_SUCCESS)
+            return LIBMSI_RESULT_CONTINUE;
+        vals[(*count)++] = id;
+        return LIBMSI_RESULT_SUCCESS;
+    }
+
+    /* null and empty strings are equal */
+    vals[(*count)++] = 0;
+    if (_libmsi_id_from_string_utf8( wv->db->strings, "", &id ) == LIBMSI_RESULT_SUCCESS && id)
+        vals[(*count)++] = id;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+/* the rows of one table visited for the rows chosen in the tables before it */
+typedef struct _LibmsiRowIter
+{
+    JOINTABLE *table;
+    unsigned row;
+    unsigned key;
+    unsigned vals[2];
+    unsigned val_count;
+    unsigned val_index;
+    MSIITERHANDLE handle;
+    bool scan;
+} LibmsiRowIter;
+
+static unsigned row_iter_lookup( LibmsiRowIter *iter )
+{
+    LibmsiView *view = iter->table->view;
+    unsigned r;
+
+    for (; iter->val_index < iter->val_count; iter->val_index++, iter->handle = NULL)
+    {
+        r = view->ops->find_matching_rows( view, iter->table->key_column->u.column.parsed.column,
+                                           iter->vals[iter->val_index], &iter->row, &iter->handle );
+        if (r == LIBMSI_RESULT_SUCCESS)
+            return r;
+        if (r != NO_MORE_ITEMS)
+            return r;
+    }
+
+    iter->row = INVALID_ROW_INDEX;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static unsigned row_iter_start( LibmsiWhereView *wv, LibmsiRowIter *iter, JOINTABLE *table,
+                                const unsigned rows[], LibmsiRecord *record )
+{
+    unsigned r;
+
+    memset( iter, 0, sizeof(*iter) );
+    iter->table = table;
+
+    if (table->access == ACCESS_INDEX)
+    {
+        r = index_values( wv, table, rows, record, iter->vals, &iter->val_count );
+        if (r == LIBMSI_RESULT_SUCCESS)
+            return row_iter_lookup( iter );
+        if (r != LIBMSI_RESULT_CONTINUE)
+            return r;
+    }
+    else if (table->access == ACCESS_HASH)
+        return join_first_row( wv, table->join, rows, &iter->key, &iter->row );
+
+    iter->scan = true;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static unsigned row_iter_next( LibmsiRowIter *iter )
+{
+    if (iter->scan)
+        iter->row++;
+    else if (iter->table->access == ACCESS_INDEX)
+        return row_iter_lookup( iter );
+    else
+        iter->row = join_next_row( iter->table->join, iter->row, iter->key );
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+/* check the conjuncts that depend on the tables joined so far, the
+ * last of which is table */
+static unsigned check_conjuncts( LibmsiWhereView *wv, const JOINTABLE *table, const unsigned rows[],
+                                 LibmsiRecord *record, int *val )
+{
+    unsigned i, r;
+
+    *val = true;
+    for (i = 0; i < table->check_count && *val; i++)
+    {
+        wv->rec_index = table->checks[i]->rec_index;
+        r = where_view_evaluate( wv, rows, table->checks[i]->expr, val, record );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            return r;
+    }
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 static unsigned check_condition( LibmsiWhereView *wv, LibmsiRecord *record, JOINTABLE **tables,
                              unsigned table_rows[] )
 {
-    unsigned r = LIBMSI_RESULT_FUNCTION_FAILED;
+    JOINTABLE *table = *tables;
+    unsigned r = LIBMSI_RESULT_FUNCTION_FAILED, ri;
+    LibmsiRowIter iter;
     int val;
 
-    for (table_rows[(*tables)->table_index] = 0;
-         table_rows[(*tables)->table_index] < (*tables)->row_count;
-         table_rows[(*tables)->table_index]++)
+    /* an index or a hash join only visits the rows that can match */
+    ri = row_iter_start( wv, &iter, table, table_rows, record );
+    if (ri != LIBMSI_RESULT_SUCCESS)
+        return ri;
+    if (!iter.scan)
+        r = LIBMSI_RESULT_SUCCESS;
+
+    while (iter.row < table->row_count)
     {
-        val = 0;
-        wv->rec_index = 0;
-        r = where_view_evaluate( wv, table_rows, wv->cond, &val, record );
-        if (r != LIBMSI_RESULT_SUCCESS && r != LIBMSI_RESULT_CONTINUE)
+        table_rows[table->table_index] = iter.row;
+        r = check_conjuncts( wv, table, table_rows, record, &val );
+        if (r != LIBMSI_RESULT_SUCCESS)
             break;
         if (val)
         {
@@ -614,14 +921,17 @@ static unsigned check_condition( LibmsiWhereView *wv, LibmsiRecord *record, JOIN
                     break;
             }
             else
-            {
-                if (r != LIBMSI_RESULT_SUCCESS)
-                    break;
                 add_row (wv, table_rows);
-            }
+        }
+
+        ri = row_iter_next( &iter );
+        if (ri != LIBMSI_RESULT_SUCCESS)
+        {
+            r = ri;
+            break;
         }
     }
-    table_rows[(*tables)->table_index] = INVALID_ROW_INDEX;
+    table_rows[table->table_index] = INVALID_ROW_INDEX;
     return r;
 }
 
@@ -672,89 +982,544 @@ static int compare_entry( const void *left, const void *right )
     return 0;
 }
 
-static void add_to_array( JOINTABLE **array, JOINTABLE *elem )
+static inline bool is_join_column( const struct expr *expr )
 {
-    while (*array && *array != elem)
-        array++;
-    if (!*array)
-        *array = elem;
+    return expr->type == EXPR_COL_NUMBER || expr->type == EXPR_COL_NUMBER32 ||
+           expr->type == EXPR_COL_NUMBER_STRING;
 }
 
-G_GNUC_PURE
-static bool in_array( JOINTABLE **array, JOINTABLE *elem )
+static bool in_join_prefix( JOINTABLE **tables, unsigned count, const JOINTABLE *table )
 {
-    while (*array && *array != elem)
-        array++;
-    return *array != NULL;
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        if (tables[i] == table)
+            return true;
+    return false;
 }
 
-#define CONST_EXPR 1 /* comparison to a constant value */
-#define JOIN_TO_CONST_EXPR 0x10000 /* comparison to a table involved with
-                                      a CONST_EXPR comaprison */
+#define JOIN_CONST  1 /* compared to a constant or a wildcard */
+#define JOIN_KEY    2 /* a key column compared to a column of a table before it */
+#define JOIN_COLUMN 3 /* compared to a column of a table before it */
 
-static unsigned reorder_check( const struct expr *expr, JOINTABLE **ordered_tables,
-                           bool process_joins, JOINTABLE **lastused )
+/* how an equality between a column of tables[level] and a value can be
+ * used to find the rows of that table */
+static int join_kind( const struct expr *column, const struct expr *value, bool strings,
+                      JOINTABLE **tables, unsigned level )
 {
-    unsigned res = 0;
+    JOINTABLE *table = tables[level];
+    unsigned type;
 
-    switch (expr->type)
+    if (!is_join_column( column ) || column->u.column.parsed.table != table ||
+        (column->type == EXPR_COL_NUMBER_STRING) != strings)
+        return 0;
+
+    if (table->view->ops->get_column_info( table->view, column->u.column.parsed.column,
+                                           NULL, &type, NULL, NULL ) != LIBMSI_RESULT_SUCCESS ||
+        MSITYPE_IS_BINARY(type))
+        return 0;
+
+    switch (value->type)
     {
-        case EXPR_WILDCARD:
-        case EXPR_SVAL:
-        case EXPR_UVAL:
-            return 0;
-        case EXPR_COL_NUMBER:
-        case EXPR_COL_NUMBER32:
-        case EXPR_COL_NUMBER_STRING:
-            if (in_array(ordered_tables, expr->u.column.parsed.table))
-                return JOIN_TO_CONST_EXPR;
-            *lastused = expr->u.column.parsed.table;
-            return CONST_EXPR;
-        case EXPR_STRCMP:
-        case EXPR_COMPLEX:
-            res = reorder_check(expr->u.expr.right, ordered_tables, process_joins, lastused);
-            /* fall through */
-        case EXPR_UNARY:
-            res += reorder_check(expr->u.expr.left, ordered_tables, process_joins, lastused);
-            if (res == 0)
-                return 0;
-            if (res == CONST_EXPR)
-                add_to_array(ordered_tables, *lastused);
-            if (process_joins && res == JOIN_TO_CONST_EXPR + CONST_EXPR)
-                add_to_array(ordered_tables, *lastused);
-            return res;
-        default:
-            g_critical("Unknown expr type: %i\n", expr->type);
-            assert(0);
-            return 0x1000000;
+    case EXPR_WILDCARD:
+        return JOIN_CONST;
+    case EXPR_UVAL:
+        return strings ? 0 : JOIN_CONST;
+    case EXPR_SVAL:
+        return strings ? JOIN_CONST : 0;
+    }
+
+    /* strings are compared with strings and numbers with numbers */
+    if (!is_join_column( value ) || (value->type == EXPR_COL_NUMBER_STRING) != strings ||
+        !in_join_prefix( tables, level, value->u.column.parsed.table ))
+        return 0;
+
+    return (type & MSITYPE_KEY) ? JOIN_KEY : JOIN_COLUMN;
+}
+
+static bool column_is_unique( const struct expr *column )
+{
+    JOINTABLE *table = column->u.column.parsed.table;
+    unsigned type;
+
+    if (table->key_count != 1)
+        return false;
+    if (table->view->ops->get_column_info( table->view, column->u.column.parsed.column,
+                                           NULL, &type, NULL, NULL ) != LIBMSI_RESULT_SUCCESS)
+        return false;
+    return (type & MSITYPE_KEY) != 0;
+}
+
+/* guesses for the fraction of rows passing a predicate, used when nothing
+ * better is known about the values of a column */
+#define EQ_SELECTIVITY    0.1
+#define OTHER_SELECTIVITY (1.0 / 3)
+
+/* the estimated fraction of a column's rows equal to one value */
+static double column_selectivity( const struct expr *column )
+{
+    JOINTABLE *table = column->u.column.parsed.table;
+
+    if (table->row_count && column_is_unique( column ))
+        return 1.0 / table->row_count;
+    return EQ_SELECTIVITY;
+}
+
+static inline double column_matches( const struct expr *column )
+{
+    return column->u.column.parsed.table->row_count * column_selectivity( column );
+}
+
+/* find the most selective conjunct of the condition comparing a column of
+ * tables[level] for equality with a value of the given kind */
+static const struct expr *find_conjunct( const struct expr *cond, JOINTABLE **tables, unsigned level,
+                                         int kind, const struct expr **column, const struct expr **value )
+{
+    const struct expr *left, *right, *ret, *rcolumn, *rvalue;
+    bool strings;
+
+    if (cond->type != EXPR_COMPLEX && cond->type != EXPR_STRCMP)
+        return NULL;
+
+    if (cond->type == EXPR_COMPLEX && cond->u.expr.op == OP_AND)
+    {
+        ret = find_conjunct( cond->u.expr.left, tables, level, kind, column, value );
+        right = find_conjunct( cond->u.expr.right, tables, level, kind, &rcolumn, &rvalue );
+        if (right && (!ret || column_matches( rcolumn ) < column_matches( *column )))
+        {
+            *column = rcolumn;
+            *value = rvalue;
+            ret = right;
+        }
+        return ret;
+    }
+
+    if (cond->u.expr.op != OP_EQ)
+        return NULL;
+
+    left = cond->u.expr.left;
+    right = cond->u.expr.right;
+    strings = cond->type == EXPR_STRCMP;
+    if (join_kind( left, right, strings, tables, level ) == kind)
+    {
+        *column = left;
+        *value = right;
+        return cond;
+    }
+    if (join_kind( right, left, strings, tables, level ) == kind)
+    {
+        *column = right;
+        *value = left;
+        return cond;
+    }
+    return NULL;
+}
+
+/* the record field a wildcard is read from, counting the wildcards in the
+ * order the condition is evaluated */
+static bool wildcard_field( const struct expr *cond, const struct expr *wildcard, unsigned *field )
+{
+    switch (cond->type)
+    {
+    case EXPR_WILDCARD:
+        (*field)++;
+        return cond == wildcard;
+    case EXPR_COMPLEX:
+    case EXPR_STRCMP:
+        return wildcard_field( cond->u.expr.left, wildcard, field ) ||
+               wildcard_field( cond->u.expr.right, wildcard, field );
+    default:
+        return false;
+    }
+}
+
+static unsigned join_hash_build( LibmsiWhereView *wv, JOINTABLE *table )
+{
+    const struct expr *build = table->key_column, *probe = table->key_value;
+    LibmsiJoinHash *hash;
+    unsigned size = 16, row, val, b, r;
+
+    while (size < table->row_count)
+        size <<= 1;
+
+    hash = msi_alloc_zero( sizeof(LibmsiJoinHash) +
+                           ((size_t)size + 2 * (size_t)table->row_count) * sizeof(unsigned) );
+    if (!hash)
+        return LIBMSI_RESULT_OUTOFMEMORY;
+
+    hash->probe = &probe->u.column;
+    hash->probe_type = probe->type;
+    hash->mask = size - 1;
+    hash->buckets = (unsigned *)(hash + 1);
+    hash->next = hash->buckets + size;
+    hash->keys = hash->next + table->row_count;
+
+    /* insert backwards so that each bucket lists its rows in order */
+    for (row = table->row_count; row-- > 0;)
+    {
+        r = table->view->ops->fetch_int( table->view, row, build->u.column.parsed.column, &val );
+        if (r != LIBMSI_RESULT_SUCCESS)
+        {
+            msi_free( hash );
+            return r;
+        }
+
+        hash->keys[row] = join_key( wv, build->type, val );
+        b = join_bucket( hash, hash->keys[row] );
+        hash->next[row] = hash->buckets[b];
+        hash->buckets[b] = row + 1;
     }
+
+    table->join = hash;
+    return LIBMSI_RESULT_SUCCESS;
 }
 
-/* reorders the tablelist in a way to evaluate the condition as fast as possible */
-static JOINTABLE **ordertables( LibmsiWhereView *wv )
+static void free_joins( LibmsiWhereView *wv )
 {
     JOINTABLE *table;
-    JOINTABLE **tables;
 
-    tables = msi_alloc_zero( (wv->table_count + 1) * sizeof(*tables) );
+    for (table = wv->tables; table; table = table->next)
+    {
+        msi_free( table->join );
+        table->join = NULL;
+        table->access = ACCESS_SCAN;
+    }
+}
 
-    if (wv->cond)
+static bool expr_in_prefix( const struct expr *expr, JOINTABLE **tables, unsigned count )
+{
+    switch (expr->type)
     {
-        table = NULL;
-        reorder_check(wv->cond, tables, false, &table);
-        table = NULL;
-        reorder_check(wv->cond, tables, true, &table);
+    case EXPR_COL_NUMBER:
+    case EXPR_COL_NUMBER32:
+    case EXPR_COL_NUMBER_STRING:
+        return in_join_prefix( tables, count, expr->u.column.parsed.table );
+    case EXPR_COMPLEX:
+    case EXPR_STRCMP:
+        return expr_in_prefix( expr->u.expr.left, tables, count ) &&
+               expr_in_prefix( expr->u.expr.right, tables, count );
+    case EXPR_UNARY:
+        return expr_in_prefix( expr->u.expr.left, tables, count );
+    default:
+        return true;
     }
+}
 
-    table = wv->tables;
-    while (table)
+static bool expr_uses_table( const struct expr *expr, const JOINTABLE *table )
+{
+    switch (expr->type)
     {
-        add_to_array(tables, table);
-        table = table->next;
+    case EXPR_COL_NUMBER:
+    case EXPR_COL_NUMBER32:
+    case EXPR_COL_NUMBER_STRING:
+        return expr->u.column.parsed.table == table;
+    case EXPR_COMPLEX:
+    case EXPR_STRCMP:
+        return expr_uses_table( expr->u.expr.left, table ) ||
+               expr_uses_table( expr->u.expr.right, table );
+    case EXPR_UNARY:
+        return expr_uses_table( expr->u.expr.left, table );
+    default:
+        return false;
+    }
+}
+
+/* the estimated fraction of row combinations passing the conjuncts that
+ * can first be checked once tables[level] is joined */
+static double conjunct_selectivity( const struct expr *cond, JOINTABLE **tables, unsigned level )
+{
+    const struct expr *left, *right;
+
+    if (cond->type == EXPR_COMPLEX && cond->u.expr.op == OP_AND)
+        return conjunct_selectivity( cond->u.expr.left, tables, level ) *
+               conjunct_selectivity( cond->u.expr.right, tables, level );
+
+    if (!expr_uses_table( cond, tables[level] ) || !expr_in_prefix( cond, tables, level + 1 ))
+        return 1.0;
+
+    if ((cond->type == EXPR_COMPLEX || cond->type == EXPR_STRCMP) && cond->u.expr.op == OP_EQ)
+    {
+        left = cond->u.expr.left;
+        right = cond->u.expr.right;
+        if (is_join_column( left ) && is_join_column( right ))
+            return MIN( column_selectivity( left ), column_selectivity( right ) );
+        if (is_join_column( left ))
+            return column_selectivity( left );
+        if (is_join_column( right ))
+            return column_selectivity( right );
+    }
+    return OTHER_SELECTIVITY;
+}
+
+/* choose how to find the rows of tables[level] for each of outer_rows
+ * combinations of the tables before it, and return what that costs.
+ * Costs count the rows read and looked up. */
+static double plan_access( LibmsiWhereView *wv, JOINTABLE **tables, unsigned level, double outer_rows )
+{
+    JOINTABLE *table = tables[level];
+    const struct expr *column, *value;
+    double cost, best;
+
+    table->access = ACCESS_SCAN;
+    best = outer_rows * table->row_count;
+    if (!wv->cond)
+        return best;
+
+    /* constants, wildcards and key columns are looked up in the view's
+     * index; other columns compared with an earlier table are hashed, so
+     * that no lasting index is built for a single query */
+    if (find_conjunct( wv->cond, tables, level, JOIN_CONST, &column, &value ) ||
+        find_conjunct( wv->cond, tables, level, JOIN_KEY, &column, &value ))
+    {
+        cost = outer_rows * (1 + column_matches( column ));
+        if (cost < best)
+        {
+            best = cost;
+            table->access = ACCESS_INDEX;
+        }
+    }
+    else if (find_conjunct( wv->cond, tables, level, JOIN_COLUMN, &column, &value ))
+    {
+        cost = table->row_count + outer_rows * (1 + column_matches( column ));
+        if (cost < best)
+        {
+            best = cost;
+            table->access = ACCESS_HASH;
+        }
+    }
+
+    if (table->access != ACCESS_SCAN)
+    {
+        table->key_column = column;
+        table->key_value = value;
+        table->key_field = 0;
+        if (value->type == EXPR_WILDCARD)
+            wildcard_field( wv->cond, value, &table->key_field );
+    }
+    return best;
+}
+
+static unsigned count_keys( JOINTABLE *table )
+{
+    unsigned i, type, count = 0;
+
+    for (i = 1; i <= table->col_count; i++)
+    {
+        if (table->view->ops->get_column_info( table->view, i, NULL, &type,
+                                               NULL, NULL ) == LIBMSI_RESULT_SUCCESS &&
+            (type & MSITYPE_KEY))
+            count++;
+    }
+    return count;
+}
+
+/* choose the join order and how the rows of each table are found.  The
+ * tables are added one at a time, each time picking the one that is
+ * cheapest to join to the tables already chosen, then the one leaving
+ * the fewest row combinations.  The estimates come from the table sizes,
+ * whether a column can be looked up and guessed predicate selectivities.
+ * The whole condition is still checked for every combination of rows. */
+static JOINTABLE **plan_joins( LibmsiWhereView *wv )
+{
+    JOINTABLE **tables, *table, *best;
+    double rows = 1, cost, est, best_cost = 0, best_rows = 0;
+    unsigned level;
+
+    tables = msi_alloc_zero( (wv->table_count + 1) * sizeof(*tables) );
+    if (!tables)
+        return NULL;
+
+    for (table = wv->tables; table; table = table->next)
+        table->key_count = count_keys( table );
+
+    for (level = 0; level < wv->table_count; level++)
+    {
+        best = NULL;
+        for (table = wv->tables; table; table = table->next)
+        {
+            if (in_join_prefix( tables, level, table ))
+                continue;
+
+            tables[level] = table;
+            cost = plan_access( wv, tables, level, rows );
+            est = rows * table->row_count;
+            if (wv->cond)
+                est *= conjunct_selectivity( wv->cond, tables, level );
+
+            if (!best || cost < best_cost ||
+                (cost == best_cost && (est < best_rows ||
+                 (est == best_rows && table->table_index < best->table_index))))
+            {
+                best = table;
+                best_cost = cost;
+                best_rows = est;
+            }
+        }
+
+        tables[level] = best;
+        plan_access( wv, tables, level, rows );
+        best->est_rows = rows = best_rows;
+        TRACE("table %d: access %d, cost %f, %f rows\n", best->table_index, best->access, best_cost, rows);
     }
     return tables;
 }
 
+/* give each conjunct to the first table in the join order at which all
+ * the columns it uses are known, so that rows are rejected as early as
+ * possible and each conjunct is checked once per row combination */
+static void attach_conjuncts( LibmsiWhereView *wv, JOINTABLE **tables )
+{
+    LibmsiConjunct **checks = wv->checks;
+    unsigned i, level;
+
+    for (level = 0; level < wv->table_count; level++)
+    {
+        tables[level]->checks = checks;
+        for (i = 0; i < wv->conjunct_count; i++)
+        {
+            if (expr_in_prefix( wv->conjuncts[i].expr, tables, level + 1 ) &&
+                (!level || !expr_in_prefix( wv->conjuncts[i].expr, tables, level )))
+                *checks++ = &wv->conjuncts[i];
+        }
+        tables[level]->check_count = checks - tables[level]->checks;
+    }
+}
+
+/* read the sizes of the joined views, which planning needs */
+static unsigned read_table_sizes( LibmsiWhereView *wv )
+{
+    JOINTABLE *table;
+    unsigned r;
+
+    for (table = wv->tables; table; table = table->next)
+    {
+        r = table->view->ops->get_dimensions(table->view, &table->row_count, NULL);
+        if (r != LIBMSI_RESULT_SUCCESS)
+        {
+            g_critical("failed to get table dimensions\n");
+            return r;
+        }
+    }
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+/* execute the joined views and read their sizes */
+static unsigned execute_tables( LibmsiWhereView *wv )
+{
+    JOINTABLE *table;
+
+    for (table = wv->tables; table; table = table->next)
+        table->view->ops->execute(table->view, NULL);
+
+    return read_table_sizes( wv );
+}
+
+/* check the rows of a single table until count of them are found */
+static unsigned stream_rows( LibmsiWhereView *wv, unsigned count )
+{
+    JOINTABLE *table = wv->tables;
+    unsigned r, row, *new_found;
+    int val;
+
+    while (wv->streaming && wv->row_count < count)
+    {
+        if (wv->candidates)
+        {
+            if (wv->next_row >= wv->candidate_count)
+                break;
+            row = wv->candidates[wv->next_row++];
+        }
+        else
+        {
+            if (wv->next_row >= table->row_count)
+                break;
+            row = wv->next_row++;
+        }
+
+        r = check_conjuncts( wv, table, &row, wv->record, &val );
+        if (r != LIBMSI_RESULT_SUCCESS)
+        {
+            end_stream( wv );
+            return r;
+        }
+        if (!val)
+            continue;
+
+        if (wv->found_size <= wv->row_count)
+        {
+            new_found = msi_realloc( wv->found, wv->found_size * 2 * sizeof(*wv->found) );
+            if (!new_found)
+            {
+                end_stream( wv );
+                return LIBMSI_RESULT_OUTOFMEMORY;
+            }
+            wv->found = new_found;
+            wv->found_size *= 2;
+        }
+        wv->found[wv->row_count++] = row;
+    }
+
+    if (wv->row_count < count)
+        end_stream( wv );
+    return LIBMSI_RESULT_SUCCESS;
+}
+
+static int compare_rows( const void *left, const void *right )
+{
+    unsigned l = *(const unsigned *)left, r = *(const unsigned *)right;
+
+    return l < r ? -1 : l > r;
+}
+
+/* prepare to check the rows of a single table as they are fetched.  Rows
+ * looked up in an index are found up front, so that they can be returned
+ * in the same order as a scan. */
+static unsigned start_stream( LibmsiWhereView *wv, JOINTABLE **tables, LibmsiRecord *record )
+{
+    JOINTABLE *table = tables[0];
+    unsigned r, size = INITIAL_REORDER_SIZE, *new, rows[1] = { INVALID_ROW_INDEX };
+    LibmsiRowIter iter;
+
+    wv->found = msi_alloc( INITIAL_REORDER_SIZE * sizeof(*wv->found) );
+    if (!wv->found)
+        return LIBMSI_RESULT_OUTOFMEMORY;
+    wv->found_size = INITIAL_REORDER_SIZE;
+
+    r = row_iter_start( wv, &iter, table, rows, record );
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
+    if (!iter.scan)
+    {
+        wv->candidates = msi_alloc( size * sizeof(*wv->candidates) );
+        if (!wv->candidates)
+            return LIBMSI_RESULT_OUTOFMEMORY;
+
+        for (; iter.row < table->row_count; r = row_iter_next( &iter ))
+        {
+            if (r != LIBMSI_RESULT_SUCCESS)
+                return r;
+
+            if (wv->candidate_count == size)
+            {
+                size *= 2;
+                new = msi_realloc( wv->candidates, size * sizeof(*wv->candidates) );
+                if (!new)
+                    return LIBMSI_RESULT_OUTOFMEMORY;
+                wv->candidates = new;
+            }
+            wv->candidates[wv->candidate_count++] = iter.row;
+        }
+        qsort( wv->candidates, wv->candidate_count, sizeof(*wv->candidates), compare_rows );
+    }
+
+    if (record)
+        wv->record = g_object_ref( record );
+    wv->next_row = 0;
+    wv->streaming = true;
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 static unsigned where_view_execute( LibmsiView *view, LibmsiRecord *record )
 {
     LibmsiWhereView *wv = (LibmsiWhereView*)view;
@@ -773,30 +1538,54 @@ static unsigned where_view_execute( LibmsiView *view, LibmsiRecord *record )
     if (r != LIBMSI_RESULT_SUCCESS)
         return r;
 
+    r = execute_tables( wv );
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
+    /* each table must have at least one row */
     do
     {
-        table->view->ops->execute(table->view, NULL);
+        if (table->row_count == 0)
+            return LIBMSI_RESULT_SUCCESS;
+    }
+    while ((table = table->next));
 
-        r = table->view->ops->get_dimensions(table->view, &table->row_count, NULL);
+    ordered_tables = plan_joins( wv );
+    if (!ordered_tables)
+        return LIBMSI_RESULT_OUTOFMEMORY;
+
+    attach_conjuncts( wv, ordered_tables );
+
+    if (wv->table_count == 1 && !wv->order_info)
+    {
+        r = start_stream( wv, ordered_tables, record );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            end_stream( wv );
+        free_joins( wv );
+        msi_free( ordered_tables );
+        return r;
+    }
+
+    for (i = 0; i < wv->table_count; i++)
+    {
+        if (ordered_tables[i]->access != ACCESS_HASH)
+            continue;
+
+        r = join_hash_build( wv, ordered_tables[i] );
         if (r != LIBMSI_RESULT_SUCCESS)
         {
-            g_critical("failed to get table dimensions\n");
+            free_joins( wv );
+            msi_free( ordered_tables );
             return r;
         }
-
-        /* each table must have at least one row */
-        if (table->row_count == 0)
-            return LIBMSI_RESULT_SUCCESS;
     }
-    while ((table = table->next));
-
-    ordered_tables = ordertables( wv );
 
     rows = msi_alloc( wv->table_count * sizeof(*rows) );
     for (i = 0; i < wv->table_count; i++)
         rows[i] = INVALID_ROW_INDEX;
 
     r =  check_condition(wv, record, ordered_tables, rows);
+    free_joins( wv );
 
     if (wv->order_info)
         wv->order_info->error = LIBMSI_RESULT_SUCCESS;
@@ -831,6 +1620,7 @@ static unsigned where_view_close( LibmsiView *view )
 static unsigned where_view_get_dimensions( LibmsiView *view, unsigned *rows, unsigned *cols )
 {
     LibmsiWhereView *wv = (LibmsiWhereView*)view;
+    unsigned r;
 
     TRACE("%p %p %p\n", wv, rows, cols );
 
@@ -841,6 +1631,9 @@ static unsigned where_view_get_dimensions( LibmsiView *view, unsigned *rows, uns
     {
         if (!wv->reorder)
             return LIBMSI_RESULT_FUNCTION_FAILED;
+        r = stream_rows( wv, ~0u );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            return r;
         *rows = wv->row_count;
     }
 
@@ -894,6 +1687,9 @@ static unsigned where_view_delete( LibmsiView *view )
     msi_free(wv->order_info);
     wv->order_info = NULL;
 
+    msi_free(wv->conjuncts);
+    msi_free(wv->checks);
+
     g_object_unref(wv->db);
     msi_free( wv );
 
@@ -904,7 +1700,7 @@ static unsigned where_view_find_matching_rows( LibmsiView *view, unsigned col,
     unsigned val, unsigned *row, MSIITERHANDLE *handle )
 {
     LibmsiWhereView *wv = (LibmsiWhereView*)view;
-    unsigned i, row_value;
+    unsigned i, r, row_value;
 
     TRACE("%p, %d, %u, %p\n", view, col, val, *handle);
 
@@ -914,6 +1710,10 @@ static unsigned where_view_find_matching_rows( LibmsiView *view, unsigned col,
     if (col == 0 || col > wv->col_count)
         return LIBMSI_RESULT_INVALID_PARAMETER;
 
+    r = stream_rows( wv, ~0u );
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
     for (i = (uintptr_t)*handle; i < wv->row_count; i++)
     {
         if (view->ops->fetch_int( view, i, col, &row_value ) != LIBMSI_RESULT_SUCCESS)
@@ -930,6 +1730,19 @@ static unsigned where_view_find_matching_rows( LibmsiView *view, unsigned col,
     return NO_MORE_ITEMS;
 }
 
+static unsigned where_view_seek( LibmsiView *view, unsigned row )
+{
+    LibmsiWhereView *wv = (LibmsiWhereView*)view;
+    unsigned *rows;
+
+    TRACE("%p %d\n", wv, row);
+
+    if (!wv->tables || !wv->reorder)
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    return find_row( wv, row, &rows );
+}
+
 static unsigned where_view_sort(LibmsiView *view, column_info *columns)
 {
     LibmsiWhereView *wv = (LibmsiWhereView *)view;
@@ -979,6 +1792,53 @@ error:
     return r;
 }
 
+static const char *access_names[] = { "SCAN", "INDEX", "HASH" };
+
+static unsigned where_view_explain( LibmsiView *view, GString *plan )
+{
+    LibmsiWhereView *wv = (LibmsiWhereView*)view;
+    JOINTABLE **ordered_tables, *table;
+    const char *table_name, *column_name;
+    unsigned r, i;
+
+    TRACE("%p %p\n", wv, plan);
+
+    if (!wv->tables)
+        return LIBMSI_RESULT_FUNCTION_FAILED;
+
+    /* the joined views are planned from their sizes, without executing them */
+    r = read_table_sizes( wv );
+    if (r != LIBMSI_RESULT_SUCCESS)
+        return r;
+
+    ordered_tables = plan_joins( wv );
+    if (!ordered_tables)
+        return LIBMSI_RESULT_OUTOFMEMORY;
+
+    for (i = 0; i < wv->table_count; i++)
+    {
+        table = ordered_tables[i];
+        r = table->view->ops->get_column_info( table->view, 1, NULL, NULL, NULL, &table_name );
+        if (r != LIBMSI_RESULT_SUCCESS)
+            break;
+
+        g_string_append_printf( plan, "%s %s", access_names[table->access], table_name );
+        if (table->access != ACCESS_SCAN)
+        {
+            r = table->view->ops->get_column_info( table->view, table->key_column->u.column.parsed.column,
+                                                   &column_name, NULL, NULL, NULL );
+            if (r != LIBMSI_RESULT_SUCCESS)
+                break;
+            g_string_append_printf( plan, " ON %s", column_name );
+        }
+        g_string_append_printf( plan, " (~%.0f rows)\n", table->est_rows );
+    }
+
+    free_joins( wv );
+    msi_free( ordered_tables );
+    return r;
+}
+
 static const LibmsiViewOps where_ops =
 {
     where_view_fetch_int,
@@ -999,6 +1859,8 @@ static const LibmsiViewOps where_ops =
     NULL,
     where_view_sort,
     NULL,
+    where_view_explain,
+    where_view_seek,
 };
 
 static unsigned where_view_verify_condition( LibmsiWhereView *wv, struct expr *cond,
@@ -1090,6 +1952,130 @@ static unsigned where_view_verify_condition( LibmsiWhereView *wv, struct expr *c
     return LIBMSI_RESULT_SUCCESS;
 }
 
+static bool same_column( const struct expr *left, const struct expr *right )
+{
+    return is_join_column( left ) && left->type == right->type &&
+           left->u.column.parsed.table == right->u.column.parsed.table &&
+           left->u.column.parsed.column == right->u.column.parsed.column;
+}
+
+static unsigned count_wildcards( const struct expr *cond )
+{
+    switch (cond->type)
+    {
+    case EXPR_WILDCARD:
+        return 1;
+    case EXPR_COMPLEX:
+    case EXPR_STRCMP:
+        return count_wildcards( cond->u.expr.left ) + count_wildcards( cond->u.expr.right );
+    default:
+        return 0;
+    }
+}
+
+static inline void set_constant( struct expr *cond, bool val )
+{
+    cond->type = EXPR_UVAL;
+    cond->u.uval = val;
+}
+
+/* replace the parts of the condition that have the same value for every
+ * row with that value.  Comparisons always have a column on their left,
+ * so these are comparisons of a column with itself and the ANDs and ORs
+ * they make constant.  Parts using markers are kept so that the markers
+ * keep their numbering. */
+static void fold_condition( struct expr *cond )
+{
+    struct expr *left, *right;
+
+    if (cond->type != EXPR_COMPLEX && cond->type != EXPR_STRCMP)
+        return;
+
+    left = cond->u.expr.left;
+    right = cond->u.expr.right;
+
+    switch (cond->u.expr.op)
+    {
+    case OP_AND:
+    case OP_OR:
+        fold_condition( left );
+        fold_condition( right );
+        if (right->type == EXPR_UVAL)
+        {
+            left = right;
+            right = cond->u.expr.left;
+        }
+        if (left->type != EXPR_UVAL)
+            break;
+
+        /* true AND x and false OR x are x */
+        if (!left->u.uval == (cond->u.expr.op == OP_OR))
+            *cond = *right;
+        else if (!count_wildcards( right ))
+            set_constant( cond, left->u.uval != 0 );
+        break;
+
+    case OP_EQ:
+    case OP_LE:
+    case OP_GE:
+        if (same_column( left, right ))
+            set_constant( cond, true );
+        break;
+
+    case OP_NE:
+    case OP_LT:
+    case OP_GT:
+        if (same_column( left, right ))
+            set_constant( cond, false );
+        break;
+    }
+}
+
+static unsigned count_conjuncts( const struct expr *cond )
+{
+    if (cond->type == EXPR_COMPLEX && cond->u.expr.op == OP_AND)
+        return count_conjuncts( cond->u.expr.left ) + count_conjuncts( cond->u.expr.right );
+    return 1;
+}
+
+static void add_conjuncts( LibmsiWhereView *wv, struct expr *cond, unsigned *rec_index )
+{
+    LibmsiConjunct *conjunct;
+
+    if (cond->type == EXPR_COMPLEX && cond->u.expr.op == OP_AND)
+    {
+        add_conjuncts( wv, cond->u.expr.left, rec_index );
+        add_conjuncts( wv, cond->u.expr.right, rec_index );
+        return;
+    }
+
+    /* always true */
+    if (cond->type == EXPR_UVAL && cond->u.uval)
+        return;
+
+    conjunct = &wv->conjuncts[wv->conjunct_count++];
+    conjunct->expr = cond;
+    conjunct->rec_index = *rec_index;
+    *rec_index += count_wildcards( cond );
+}
+
+/* split the condition into the conjuncts checked as the tables are joined */
+static unsigned compile_condition( LibmsiWhereView *wv )
+{
+    unsigned count, rec_index = 0;
+
+    fold_condition( wv->cond );
+
+    count = count_conjuncts( wv->cond );
+    wv->conjuncts = msi_alloc( count * sizeof(*wv->conjuncts) );
+    wv->checks = msi_alloc( count * sizeof(*wv->checks) );
+    if (!wv->conjuncts || !wv->checks)
+        return LIBMSI_RESULT_OUTOFMEMORY;
+
+    add_conjuncts( wv, wv->cond, &rec_index );
+    return LIBMSI_RESULT_SUCCESS;
+}
+
 unsigned where_view_create( LibmsiDatabase *db, LibmsiView **view, char *tables,
                        struct expr *cond )
 {
@@ -1115,7 +2101,7 @@ unsigned where_view_create( LibmsiDatabase *db, LibmsiView **view, char *tables,
         if ((ptr = strchr(tables, ' ')))
             *ptr = '\0';
 
-        table = msi_alloc(sizeof(JOINTABLE));
+        table = msi_alloc_zero(sizeof(JOINTABLE));
         if (!table)
         {
             r = LIBMSI_RESULT_OUTOFMEMORY;
@@ -1160,6 +2146,10 @@ unsigned where_view_create( LibmsiDatabase *db, LibmsiView **view, char *tables,
             r = LIBMSI_RESULT_FUNCTION_FAILED;
             goto end;
         }
+
+        r = compile_condition( wv );
+        if( r != LIBMSI_RESULT_SUCCESS )
+            goto end;
     }
 
     *view = (LibmsiView*) wv;
@@ -35,6 +35,8 @@
 
 #include <libmsi.h>
 #include <glib/gstdio.h>
+#include <gsf/gsf-infile-msole.h>
+#include <gsf/gsf-input-stdio.h>
 
 #include "test.h"
 
@@ -1407,6 +1409,48 @@ static void test_binary(void)
 
     g_object_unref( hdb );
 
+    /* the stream name is longer than a table name can be */
+    hdb = libmsi_database_new( msifile, LIBMSI_DB_FLAGS_TRANSACT, NULL, NULL );
+    ok(hdb , "Failed to open database\n" );
+
+    create_file( "test.txt" );
+    rec = libmsi_record_new( 1 );
+    r = libmsi_record_load_stream( rec, 1, "test.txt" );
+    ok(r, "Failed to add stream data to the record: %d\n", r);
+    unlink( "test.txt" );
+
+    sql = "INSERT INTO `Binary` ( `Name`, `ID`, `Data` ) VALUES ( 'SomeLongCustomActionDll', 2, ? )";
+    r = run_query( hdb, rec, sql );
+    ok( r == LIBMSI_RESULT_SUCCESS, "Insert into Binary table failed: %d\n", r );
+
+    g_object_unref( rec );
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Failed to commit database\n" );
+
+    g_object_unref( hdb );
+
+    hdb = libmsi_database_new( msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL );
+    ok(hdb , "Failed to open database\n" );
+
+    sql = "SELECT * FROM `Binary` WHERE `Name` = 'SomeLongCustomActionDll'";
+    r = do_query( hdb, sql, &rec );
+    ok( r == LIBMSI_RESULT_SUCCESS, "SELECT query failed: %d\n", r );
+
+    check_record_string (rec, 1, "SomeLongCustomActionDll");
+
+    size = sizeof(buf);
+    memset( buf, 0, sizeof(buf) );
+    in = libmsi_record_get_stream(rec, 3);
+    ok(in, "Failed to get stream\n");
+    size = g_input_stream_read(in, buf, sizeof(buf), NULL, NULL);
+    ok( g_str_equal(buf, "test.txt\n"), "Expected 'test.txt\\n', got %s\n", buf );
+    g_object_unref(in);
+
+    g_object_unref( rec );
+
+    g_object_unref( hdb );
+
     unlink( msifile );
 }
 
@@ -1643,6 +1687,38 @@ static void test_where(void)
     libmsi_query_close(query, NULL);
     g_object_unref(query);
 
+    /* rows are found as they are fetched, execute again before the last one */
+    sql = "SELECT `DiskId` FROM `Media` WHERE `LastSequence` >= ?";
+    query = libmsi_query_new(hdb, sql, NULL);
+    ok(query, "failed to open query\n");
+
+    rec = libmsi_record_new(1);
+    libmsi_record_set_int(rec, 1, 1);
+    r = libmsi_query_execute(query, rec, NULL);
+    ok(r, "failed to execute query\n");
+    g_object_unref(rec);
+
+    rec = libmsi_query_fetch(query, NULL);
+    ok(rec, "failed to fetch query\n");
+    check_record_string(rec, 1, "2");
+    g_object_unref(rec);
+
+    rec = libmsi_record_new(1);
+    libmsi_record_set_int(rec, 1, 2);
+    r = libmsi_query_execute(query, rec, NULL);
+    ok(r, "failed to execute query\n");
+    g_object_unref(rec);
+
+    rec = libmsi_query_fetch(query, NULL);
+    ok(rec, "failed to fetch query\n");
+    check_record_string(rec, 1, "3");
+    g_object_unref(rec);
+
+    query_check_no_more(query);
+
+    libmsi_query_close(query, NULL);
+    g_object_unref(query);
+
     g_object_unref( hdb );
     unlink(msifile);
 }
@@ -3316,6 +3392,99 @@ static void test_join(void)
     libmsi_query_close(hquery, NULL);
     g_object_unref(hquery);
 
+    sql = "INSERT INTO `One` (`A`, `B`) VALUES (13, 3)";
+    r = run_query( hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "cannot insert into table: %d\n", r );
+
+    sql = "INSERT INTO `One` (`A`, `B`) VALUES (14, 5)";
+    r = run_query( hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "cannot insert into table: %d\n", r );
+
+    sql = "INSERT INTO `One` (`A`, `B`) VALUES (15, 3)";
+    r = run_query( hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "cannot insert into table: %d\n", r );
+
+    sql = "INSERT INTO `One` (`A`, `B`) VALUES (16, 3)";
+    r = run_query( hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "cannot insert into table: %d\n", r );
+
+    sql = "INSERT INTO `Three` (`E`, `F`) VALUES (4, 20)";
+    r = run_query( hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "cannot insert into table: %d\n", r );
+
+    /* join three tables on their columns, with a filter on the result */
+    sql = "SELECT `A`, `D`, `F` FROM `One`, `Two`, `Three` "
+            "WHERE `B` = `C` AND `D` = `E` AND `A` <> 16";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "failed to open query\n");
+
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok( r, "failed to execute query: %d\n", r );
+
+    i = 0;
+    data_correct = true;
+    while ((hrec = libmsi_query_fetch(hquery, &error)) != NULL)
+    {
+        count = libmsi_record_get_field_count( hrec );
+        ok( count == 3, "Expected 3 record fields, got %d\n", count );
+
+        if (libmsi_record_get_int( hrec, 1 ) != (i ? 15 : 13) ||
+            libmsi_record_get_int( hrec, 2 ) != 4 ||
+            libmsi_record_get_int( hrec, 3 ) != 20)
+            data_correct = false;
+
+        i++;
+        g_object_unref(hrec);
+    }
+    ok( data_correct, "data returned in the wrong order\n");
+
+    ok( i == 2, "Expected 2 rows, got %d\n", i );
+    g_assert_no_error(error);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+
+    /* comparisons of a column with itself are constant */
+    sql = "SELECT `A`, `D`, `F` FROM `One`, `Two`, `Three` "
+            "WHERE `A` = `A` AND `B` = `C` AND (`D` = `E` OR `F` <> `F`) AND `A` <> 16";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "failed to open query\n");
+
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok( r, "failed to execute query: %d\n", r );
+
+    i = 0;
+    data_correct = true;
+    while ((hrec = libmsi_query_fetch(hquery, &error)) != NULL)
+    {
+        if (libmsi_record_get_int( hrec, 1 ) != (i ? 15 : 13) ||
+            libmsi_record_get_int( hrec, 2 ) != 4 ||
+            libmsi_record_get_int( hrec, 3 ) != 20)
+            data_correct = false;
+
+        i++;
+        g_object_unref(hrec);
+    }
+    ok( data_correct, "data returned in the wrong order\n");
+
+    ok( i == 2, "Expected 2 rows, got %d\n", i );
+    g_assert_no_error(error);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+
+    sql = "SELECT * FROM `One`, `Two` WHERE `B` = `C` AND `A` < `A`";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "failed to open query\n");
+
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok( r, "failed to execute query: %d\n", r );
+
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+
     sql = "SELECT * FROM `Four`, `Five`";
     hquery = libmsi_query_new(hdb, sql, NULL);
     ok(hquery, "failed to open query\n");
@@ -3336,6 +3505,87 @@ static void test_join(void)
     unlink(msifile);
 }
 
+static void check_explain( LibmsiDatabase *hdb, const char *sql, const char *expected )
+{
+    GError *error = NULL;
+    LibmsiQuery *hquery;
+    gchar *plan;
+
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "failed to open query\n");
+
+    plan = libmsi_query_explain(hquery, &error);
+    g_assert_no_error(error);
+    ok( !g_strcmp0( plan, expected ), "Expected plan %s, got %s\n", expected, plan );
+
+    g_free(plan);
+    g_object_unref(hquery);
+}
+
+static void test_explain(void)
+{
+    LibmsiDatabase *hdb;
+    unsigned r;
+
+    hdb = create_db();
+    ok( hdb, "failed to create db\n");
+
+    r = create_component_table( hdb );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot create Component table: %d\n", r );
+
+    r = add_component_entry( hdb, "'zygomatic', 'malar', 'INSTALLDIR', 0, '', ''" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add component: %d\n", r );
+
+    r = add_component_entry( hdb, "'maxilla', 'alveolar', 'INSTALLDIR', 0, '', ''" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add component: %d\n", r );
+
+    r = add_component_entry( hdb, "'nasal', 'septum', 'INSTALLDIR', 0, '', ''" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add component: %d\n", r );
+
+    r = add_component_entry( hdb, "'mandible', 'ramus', 'INSTALLDIR', 0, '', ''" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add component: %d\n", r );
+
+    r = create_feature_components_table( hdb );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot create FeatureComponents table: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'procerus', 'maxilla'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'procerus', 'nasal'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'nasalis', 'nasal'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'nasalis', 'mandible'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'nasalis', 'notacomponent'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    r = add_feature_components_entry( hdb, "'mentalis', 'zygomatic'" );
+    ok( r == LIBMSI_RESULT_SUCCESS, "cannot add feature components: %d\n", r );
+
+    check_explain( hdb, "SELECT * FROM `Component`",
+                   "SCAN Component (~4 rows)\n" );
+
+    /* the primary key is unique, so a single row is expected */
+    check_explain( hdb, "SELECT * FROM `Component` WHERE `Component` = 'nasal'",
+                   "INDEX Component ON Component (~1 rows)\n" );
+
+    /* the smaller table is read first, the other is looked up by its key */
+    check_explain( hdb, "SELECT `FeatureComponents`.`Feature_` FROM `FeatureComponents`, `Component` "
+                   "WHERE `FeatureComponents`.`Component_` = `Component`.`Component`",
+                   "SCAN Component (~4 rows)\n"
+                   "INDEX FeatureComponents ON Component_ (~2 rows)\n" );
+
+    check_explain( hdb, "DELETE FROM `FeatureComponents` WHERE `Feature_` = 'nasalis'",
+                   "INDEX FeatureComponents ON Feature_ (~1 rows)\n" );
+
+    g_object_unref(hdb);
+    unlink(msifile);
+}
+
 static void test_temporary_table(void)
 {
     GError *error = NULL;
@@ -5191,6 +5441,623 @@ static void test_deleterow(void)
     unlink(msifile);
 }
 
+static void test_commit_twice(void)
+{
+    LibmsiDatabase *hdb;
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    unsigned r = 0;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `Table` ( `A` CHAR(72) NOT NULL PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`) VALUES ('one')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    /* the database is still usable after the commit */
+    sql = "INSERT INTO `Table` (`A`) VALUES ('one')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_FUNCTION_FAILED, "Expected LIBMSI_RESULT_FUNCTION_FAILED, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`) VALUES ('two')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    g_object_unref(hdb);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "SELECT * FROM `Table`";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "one");
+    g_object_unref(hrec);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "two");
+    g_object_unref(hrec);
+
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+    g_object_unref(hdb);
+    unlink(msifile);
+}
+
+/* the size of a stream of a database file, -1 if there is none */
+static gssize stream_size(const char *path, const WCHAR *name)
+{
+    GsfInput *in;
+    GsfInfile *stg;
+    GsfInput *stm;
+    char *name8;
+    gssize size = -1;
+
+    in = gsf_input_stdio_new(path, NULL);
+    if (!in)
+        return -1;
+    stg = gsf_infile_msole_new(in, NULL);
+    g_object_unref(in);
+    if (!stg)
+        return -1;
+
+    name8 = g_utf16_to_utf8((const gunichar2 *)name, -1, NULL, NULL, NULL);
+    stm = gsf_infile_child_by_name(stg, name8);
+    if (stm)
+    {
+        size = gsf_input_size(stm);
+        g_object_unref(stm);
+    }
+    g_free(name8);
+    g_object_unref(stg);
+    return size;
+}
+
+static void test_compact_commit(void)
+{
+    LibmsiDatabase *hdb;
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    char buf[256];
+    unsigned r = 0;
+    int i;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE | LIBMSI_DB_FLAGS_COMPACT, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `Table` ( `A` INT NOT NULL, `B` CHAR(72) PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`, `B`) VALUES (1, 'one')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`, `B`) VALUES (2, 'two')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* leave strings behind that no row refers to */
+    for (i = 0; i < 10; i++)
+    {
+        sprintf(buf, "UPDATE `Table` SET `B` = 'value%d' WHERE `A` = 1", i);
+        r = run_query(hdb, 0, buf);
+        ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    }
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    sql = "INSERT INTO `Table` (`A`, `B`) VALUES (3, 'three')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    g_object_unref(hdb);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "SELECT `B` FROM `Table` ORDER BY `A`";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "value9");
+    g_object_unref(hrec);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "two");
+    g_object_unref(hrec);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "three");
+    g_object_unref(hrec);
+
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+    g_object_unref(hdb);
+
+    /* only Table, A, B, value9, two and three are left, numbered 1 to 6 */
+    r = stream_size(msifile, _StringPool) / 4;
+    ok(r == 7, "Expected 7 string pool entries, got %u\n", r);
+
+    unlink(msifile);
+}
+
+static void check_query_strings(LibmsiDatabase *hdb, const char *sql, const char **expect)
+{
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    unsigned r;
+
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    for (; *expect; expect++)
+    {
+        hrec = libmsi_query_fetch(hquery, NULL);
+        ok(hrec, "query fetch failed\n");
+        if (!hrec)
+            break;
+        check_record_string(hrec, 1, *expect);
+        g_object_unref(hrec);
+    }
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+}
+
+static void test_compact_untouched(void)
+{
+    static const char *table_strings[] = { "value9", "two", NULL };
+    static const char *other_strings[] = { "apple", "pear", NULL };
+    static const char *other_strings2[] = { "apple", "pear", "plum", NULL };
+    LibmsiDatabase *hdb;
+    const char *sql;
+    char buf[256];
+    unsigned r = 0;
+    int i;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `Table` ( `A` INT NOT NULL, `B` CHAR(72) PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`, `B`) VALUES (1, 'one')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Table` (`A`, `B`) VALUES (2, 'two')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    for (i = 0; i < 10; i++)
+    {
+        sprintf(buf, "UPDATE `Table` SET `B` = 'value%d' WHERE `A` = 1", i);
+        r = run_query(hdb, 0, buf);
+        ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    }
+
+    /* the strings of Other come after the ones compacting leaves out */
+    sql = "CREATE TABLE `Other` ( `A` INT NOT NULL, `B` CHAR(72) PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Other` (`A`, `B`) VALUES (1, 'apple')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `Other` (`A`, `B`) VALUES (2, 'pear')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    g_object_unref(hdb);
+
+    /* compact without loading the tables, then read them from the
+     * compacted file */
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_TRANSACT | LIBMSI_DB_FLAGS_COMPACT, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    check_query_strings(hdb, "SELECT `B` FROM `Other` ORDER BY `A`", other_strings);
+
+    sql = "INSERT INTO `Other` (`A`, `B`) VALUES (3, 'plum')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* Table is still only in the compacted file */
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    check_query_strings(hdb, "SELECT `B` FROM `Table` ORDER BY `A`", table_strings);
+    g_object_unref(hdb);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    check_query_strings(hdb, "SELECT `B` FROM `Table` ORDER BY `A`", table_strings);
+    check_query_strings(hdb, "SELECT `B` FROM `Other` ORDER BY `A`", other_strings2);
+    g_object_unref(hdb);
+
+    /* Table, Other, A, B, value9, two, apple, pear and plum */
+    r = stream_size(msifile, _StringPool) / 4;
+    ok(r == 10, "Expected 10 string pool entries, got %u\n", r);
+
+    unlink(msifile);
+}
+
+static void test_compact_unloadable(void)
+{
+    static const WCHAR table_t[] = {0x4840, 0x481d, 0}; /* T */
+    LibmsiDatabase *hdb;
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    gssize size;
+    unsigned r = 0;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `T` ( `A` SHORT NOT NULL PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `T` (`A`) VALUES (1)";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `U` ( `A` SHORT NOT NULL, `B` CHAR(72) PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `U` (`A`, `B`) VALUES (1, 'one')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    g_object_unref(hdb);
+
+    size = stream_size(msifile, table_t);
+    ok(size == 2, "Expected 2, got %d\n", (int)size);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_TRANSACT | LIBMSI_DB_FLAGS_COMPACT, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* without its columns T can't be loaded any more */
+    sql = "DELETE FROM `_Columns` WHERE `Table` = 'T'";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "INSERT INTO `U` (`A`, `B`) VALUES (2, 'two')";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* the pool is then saved as it is, and T is copied unchanged */
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    g_object_unref(hdb);
+
+    size = stream_size(msifile, table_t);
+    ok(size == 2, "Expected 2, got %d\n", (int)size);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "SELECT `B` FROM `U` ORDER BY `A`";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "one");
+    g_object_unref(hrec);
+
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    check_record_string(hrec, 1, "two");
+    g_object_unref(hrec);
+
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+    g_object_unref(hdb);
+    unlink(msifile);
+}
+
+static void test_decode_threads(void)
+{
+    LibmsiDatabase *hdb;
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    char buf[256];
+    unsigned r = 0;
+    int i;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `Table` ( `A` INT NOT NULL, `B` CHAR(72) NOT NULL PRIMARY KEY `B` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* enough strings for the pool to be decoded on several threads */
+    for (i = 0; i < 5000; i++)
+    {
+        sprintf(buf, "INSERT INTO `Table` (`A`, `B`) VALUES (%d, 'string%d')", i, i);
+        r = run_query(hdb, 0, buf);
+        ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    }
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    g_object_unref(hdb);
+
+    g_setenv("LIBMSI_DECODE_THREADS", "4", TRUE);
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    g_unsetenv("LIBMSI_DECODE_THREADS");
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* every string is read back under its id */
+    sql = "SELECT `B` FROM `Table` ORDER BY `A`";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    for (i = 0; i < 5000; i++)
+    {
+        hrec = libmsi_query_fetch(hquery, NULL);
+        ok(hrec, "query fetch failed\n");
+        if (!hrec)
+            break;
+        sprintf(buf, "string%d", i);
+        check_record_string(hrec, 1, buf);
+        g_object_unref(hrec);
+    }
+    query_check_no_more(hquery);
+
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+
+    /* and every id is found from its string */
+    sql = "SELECT `A` FROM `Table` WHERE `B` = ?";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    for (i = 0; i < 5000; i++)
+    {
+        hrec = libmsi_record_new(1);
+        sprintf(buf, "string%d", i);
+        libmsi_record_set_string(hrec, 1, buf);
+        r = libmsi_query_execute(hquery, hrec, NULL);
+        ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+        g_object_unref(hrec);
+
+        hrec = libmsi_query_fetch(hquery, NULL);
+        ok(hrec, "string%d not found\n", i);
+        if (hrec)
+        {
+            r = libmsi_record_get_int(hrec, 1);
+            ok(r == i, "Expected %d, got %d\n", i, r);
+            g_object_unref(hrec);
+        }
+        libmsi_query_close(hquery, NULL);
+    }
+
+    g_object_unref(hquery);
+    g_object_unref(hdb);
+    unlink(msifile);
+}
+
+#define STRREF_ROWS 62000
+
+static void check_strref_rows(LibmsiDatabase *hdb)
+{
+    static const int rows[] = { 0, STRREF_ROWS - 1, STRREF_ROWS };
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    char buf[256];
+    unsigned r, i;
+
+    sql = "SELECT `B` FROM `S` WHERE `A` = ?";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    for (i = 0; i < G_N_ELEMENTS(rows); i++)
+    {
+        hrec = libmsi_record_new(1);
+        libmsi_record_set_int(hrec, 1, rows[i]);
+        r = libmsi_query_execute(hquery, hrec, NULL);
+        ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+        g_object_unref(hrec);
+
+        hrec = libmsi_query_fetch(hquery, NULL);
+        ok(hrec, "row %d not found\n", rows[i]);
+        if (hrec)
+        {
+            if (rows[i] == STRREF_ROWS)
+                strcpy(buf, "extra");
+            else
+                sprintf(buf, "string%d", rows[i]);
+            check_record_string(hrec, 1, buf);
+            g_object_unref(hrec);
+        }
+        libmsi_query_close(hquery, NULL);
+    }
+    g_object_unref(hquery);
+
+    /* the new string is also found from its id */
+    sql = "SELECT `A` FROM `S` WHERE `B` = 'extra'";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+    r = libmsi_query_execute(hquery, 0, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    hrec = libmsi_query_fetch(hquery, NULL);
+    ok(hrec, "query fetch failed\n");
+    if (hrec)
+    {
+        r = libmsi_record_get_int(hrec, 1);
+        ok(r == STRREF_ROWS, "Expected %d, got %d\n", STRREF_ROWS, r);
+        g_object_unref(hrec);
+    }
+    query_check_no_more(hquery);
+    libmsi_query_close(hquery, NULL);
+    g_object_unref(hquery);
+}
+
+static void test_strref_roundtrip(void)
+{
+    static const WCHAR table_s[] = {0x4840, 0x481c, 0}; /* S */
+    LibmsiDatabase *hdb;
+    LibmsiQuery *hquery;
+    LibmsiRecord *hrec;
+    const char *sql;
+    char buf[256];
+    gssize size;
+    unsigned r = 0;
+    int i;
+
+    unlink(msifile);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_CREATE, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sql = "CREATE TABLE `S` ( `A` LONG NOT NULL, `B` CHAR(72) PRIMARY KEY `A` )";
+    r = run_query(hdb, 0, sql);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    /* S, A, B and the strings of the rows leave the string table with room
+     * for 92168 ids, so the highest ids of the pool have no string and
+     * string references take 3 bytes */
+    sql = "INSERT INTO `S` (`A`, `B`) VALUES (?, ?)";
+    hquery = libmsi_query_new(hdb, sql, NULL);
+    ok(hquery, "Expected LIBMSI_RESULT_SUCCESS\n");
+
+    hrec = libmsi_record_new(2);
+    for (i = 0; i < STRREF_ROWS; i++)
+    {
+        sprintf(buf, "string%d", i);
+        libmsi_record_set_int(hrec, 1, i);
+        libmsi_record_set_string(hrec, 2, buf);
+        r = libmsi_query_execute(hquery, hrec, NULL);
+        ok(r, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+        libmsi_query_close(hquery, NULL);
+    }
+    g_object_unref(hrec);
+    g_object_unref(hquery);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    g_object_unref(hdb);
+
+    r = stream_size(msifile, _StringPool) / 4;
+    ok(r == 92168, "Expected 92168 string pool entries, got %u\n", r);
+    size = stream_size(msifile, table_s);
+    ok(size == STRREF_ROWS * 7, "Expected %d, got %d\n", STRREF_ROWS * 7, (int)size);
+
+    /* the reopened pool keeps its empty ids and its 3 byte references,
+     * and a new string takes the first id without a string */
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_TRANSACT, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    sprintf(buf, "INSERT INTO `S` (`A`, `B`) VALUES (%d, 'extra')", STRREF_ROWS);
+    r = run_query(hdb, 0, buf);
+    ok(r == LIBMSI_RESULT_SUCCESS, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    check_strref_rows(hdb);
+    g_object_unref(hdb);
+
+    r = stream_size(msifile, _StringPool) / 4;
+    ok(r == 92168, "Expected 92168 string pool entries, got %u\n", r);
+    size = stream_size(msifile, table_s);
+    ok(size == (STRREF_ROWS + 1) * 7, "Expected %d, got %d\n", (STRREF_ROWS + 1) * 7, (int)size);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    check_strref_rows(hdb);
+    g_object_unref(hdb);
+
+    /* compacting drops the empty ids, and the references shrink to 2 bytes */
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_TRANSACT | LIBMSI_DB_FLAGS_COMPACT, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+
+    r = libmsi_database_commit(hdb, NULL);
+    ok(r, "Expected LIBMSI_RESULT_SUCCESS\n");
+    check_strref_rows(hdb);
+    g_object_unref(hdb);
+
+    r = stream_size(msifile, _StringPool) / 4;
+    ok(r == STRREF_ROWS + 5, "Expected %d string pool entries, got %u\n", STRREF_ROWS + 5, r);
+    size = stream_size(msifile, table_s);
+    ok(size == (STRREF_ROWS + 1) * 6, "Expected %d, got %d\n", (STRREF_ROWS + 1) * 6, (int)size);
+
+    hdb = libmsi_database_new(msifile, LIBMSI_DB_FLAGS_READONLY, NULL, NULL);
+    ok(hdb, "Expected LIBMSI_RESULT_SUCCESS, got %d\n", r);
+    check_strref_rows(hdb);
+    g_object_unref(hdb);
+
+    unlink(msifile);
+}
+
 static const char import_dat[] = "A\n"
                                  "s72\n"
                                  "Table\tA\n"
@@ -7492,6 +8359,7 @@ int main()
     test_try_transform();
 #endif
     test_join();
+    test_explain();
     test_temporary_table();
     test_alter();
     test_integers();
@@ -7508,6 +8376,12 @@ int main()
 #if 0
     test_deleterow();
 #endif
+    test_commit_twice();
+    test_compact_commit();
+    test_compact_untouched();
+    test_compact_unloadable();
+    test_decode_threads();
+    test_strref_roundtrip();
     test_quotes();
     test_carriagereturn();
     test_noquotes();